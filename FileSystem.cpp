@@ -1,25 +1,308 @@
 #include <string>
+#include <cstring>
+#include <algorithm>
 #include <fstream>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
-#include <tic.h>
 #include <sstream>
+#include <thread>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
 #include "FileSystem.h"
 
 #define ROOT 127
 #define NUM_INODES 126
-#define NUM_BLOCKS 16000
+#define NUM_BLOCKS 128
+#define EXT_START NUM_BLOCKS
+#define EXT_BLOCKS 4
+#define EXT_MAGIC "UFSX"
+#define FEATURE_COMPRESS 0x1
+#define FEATURE_CHECKSUM 0x2
+#define FEATURE_DEDUP 0x4
+#define FEATURE_JOURNAL 0x8
+#define FEATURE_QUOTA 0x10
+#define FEATURE_TIER 0x20
+#define TIER_INTERVAL 64            // commands between two migrator passes
+#define TIER_HOT 8                  // accesses that bring a file back to the fast tier
+#define TIER_COLD_PASSES 4          // passes without an access that send a file to the slow tier
+#define JOURNAL_START (EXT_START + EXT_BLOCKS)
+#define JOURNAL_PAYLOAD (1024 + 1024 * EXT_BLOCKS)
+#define JOURNAL_RECORD (1024 + JOURNAL_PAYLOAD)
+#define JOURNAL_MAGIC "UFSJ"
+#define POOL_START (JOURNAL_START + 2 * JOURNAL_RECORD / 1024)
+#define POOL_BLOCKS NUM_BLOCKS                      // one more than the blocks that can be packed at once
+#define POOL_GRANULE 64
+#define GRANULES_PER_BLOCK (1024 / POOL_GRANULE)
+#define JOURNAL_DATA_START (POOL_START + POOL_BLOCKS)
+#define JOURNAL_DATA_BLOCKS (2 * (NUM_BLOCKS - 1 + POOL_BLOCKS))  // every data and pool block of both tiers
+#define JOURNAL_SLOW 0x8000                         // index entry of a block on the slow tier
+#define READAHEAD_BLOCKS 16
+#define INODE_SLOTS 128             // inodes in the inode table, a whole number of 16-inode chunks
+#define NO_PARENT 0xff              // parent of the unused inodes in the inode table
+#define ANY_PARENT -1
+#define MAX_REQUEST 4096
+#define IDLE_COMMIT_MS 100          // idle time after which a server commits the pending journal group
+#define MAX_OUTPUT 65536            // queued response bytes past which a connection is not read from
+#define CRC32C_POLY 0x82f63b78
+#define CRC32C_STRIPE 336
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 10
 #define MOUNT_ERROR() std::cerr << "Error: No file system is mounted\n"
 #define COMMAND_ERROR(file, line) std::cerr << "Command Error: " << file << ", " << line << std::endl
 #define FILE_NOT_EXIST(file) std::cerr << "Error: File or directory " << file <<" does not exist\n"
 #define FILE_EXIST(file) std::cerr << "Error: File or directory " << file <<" already exists\n"
+#define DEVICE_ERROR(index) std::cerr << "Error: Cannot access block " << (int) (index) << " on " << current_disk << std::endl
+
+/*
+ * Copies len bytes between two files without bouncing them through user space when the kernel allows it,
+ * falling back from copy_file_range to sendfile and finally to a plain read/write loop.
+ */
+bool copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, size_t len) {
+    while (len) {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+        if (n <= 0) {
+            break;
+        }
+        len -= n;
+    }
+
+    if (len && lseek(out_fd, out_off, SEEK_SET) == out_off) {
+        while (len) {
+            ssize_t n = sendfile(out_fd, in_fd, &in_off, len);
+            if (n <= 0) {
+                break;
+            }
+            out_off += n;
+            len -= n;
+        }
+    }
+
+    std::vector<char> chunk(std::min(len, (size_t) 1024 * NUM_BLOCKS));
+    while (len) {
+        ssize_t n = pread(in_fd, chunk.data(), std::min(len, chunk.size()), in_off);
+        if (n <= 0 || pwrite(out_fd, chunk.data(), n, out_off) != n) {
+            return false;
+        }
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * The storage a disk lives on, read and written in whole blocks. Blocks past the data blocks hold the extension
+ * area and the journal.
+ */
+class Block_device {
+public:
+    virtual ~Block_device() {}
+    virtual bool read(int first, int count, char *data) = 0;
+    virtual bool write(int first, int count, const char *data) = 0;
+    // zeroes count blocks, handing their space back where the backend can
+    virtual bool zero(int first, int count) = 0;
+    // makes every write so far durable
+    virtual bool flush() = 0;
+    // number of blocks the device holds
+    virtual int size() = 0;
+    // copies bytes of a host file to the blocks from first on, or the other way, without a block at a time in between
+    virtual bool copy_from(int in_fd, int first, size_t bytes) = 0;
+    virtual bool copy_to(int first, int out_fd, size_t bytes) = 0;
+};
+
+// a disk image file on the host
+class File_device : public Block_device {
+public:
+    int fd;
+
+    File_device(const char *path) {
+        fd = open(path, O_RDWR);
+    }
+
+    ~File_device() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // blocks past the end of the file read as zeros
+    bool read(int first, int count, char *data) {
+        ssize_t n = pread(fd, data, 1024 * count, 1024 * (off_t) first);
+        memset(data + std::max(n, (ssize_t) 0), 0, 1024 * count - std::max(n, (ssize_t) 0));
+        return n >= 0;
+    }
+
+    bool write(int first, int count, const char *data) {
+        return pwrite(fd, data, 1024 * count, 1024 * (off_t) first) == 1024 * count;
+    }
+
+    bool zero(int first, int count) {
+        // the host only hands back whole blocks of its own, so the punch takes in the rest of them if that is zero
+        struct stat st;
+        int per_host_block = fstat(fd, &st) == 0 ? std::max(1, (int) (st.st_blksize / 1024)) : 1;
+        int start = first / per_host_block * per_host_block;
+        int end = (first + count + per_host_block - 1) / per_host_block * per_host_block;
+        if (start < first || end > first + count) {
+            std::vector<char> around(1024 * (end - start));
+            if (read(start, end - start, around.data())
+                    && std::all_of(around.begin(), around.begin() + 1024 * (first - start), [](char c) { return c == 0; })
+                    && std::all_of(around.begin() + 1024 * (first + count - start), around.end(), [](char c) { return c == 0; })) {
+                first = start;
+                count = end - start;
+            }
+        }
+
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 1024 * (off_t) first, 1024 * (off_t) count) == 0) {
+            return true;
+        }
+
+        std::vector<char> data(1024 * count, 0);
+        return write(first, count, data.data());
+    }
+
+    bool flush() {
+        return fdatasync(fd) == 0;
+    }
+
+    int size() {
+        struct stat st;
+        return fstat(fd, &st) == 0 ? (st.st_size + 1023) / 1024 : 0;
+    }
+
+    bool copy_from(int in_fd, int first, size_t bytes) {
+        return copy_range(in_fd, 0, fd, 1024 * (off_t) first, bytes);
+    }
+
+    bool copy_to(int first, int out_fd, size_t bytes) {
+        return copy_range(fd, 1024 * (off_t) first, out_fd, 0, bytes);
+    }
+};
+
+// a disk held entirely in memory, which grows as blocks past its end are written
+class Memory_device : public Block_device {
+public:
+    std::vector<char> image;
+
+    // blocks past the end of the image read as zeros
+    bool read(int first, int count, char *data) {
+        size_t offset = std::min((size_t) 1024 * first, image.size());
+        size_t bytes = std::min((size_t) 1024 * count, image.size() - offset);
+        memcpy(data, image.data() + offset, bytes);
+        memset(data + bytes, 0, 1024 * count - bytes);
+        return true;
+    }
+
+    bool write(int first, int count, const char *data) {
+        if (image.size() < (size_t) 1024 * (first + count)) {
+            image.resize(1024 * (first + count), 0);
+        }
+        memcpy(&image[1024 * first], data, 1024 * count);
+        return true;
+    }
+
+    bool zero(int first, int count) {
+        size_t offset = std::min((size_t) 1024 * first, image.size());
+        memset(image.data() + offset, 0, std::min((size_t) 1024 * count, image.size() - offset));
+        return true;
+    }
+
+    bool flush() {
+        return true;
+    }
+
+    int size() {
+        return (image.size() + 1023) / 1024;
+    }
+
+    bool copy_from(int in_fd, int first, size_t bytes) {
+        size_t offset = 1024 * (size_t) first;
+        if (image.size() < offset + bytes) {
+            image.resize((offset + bytes + 1023) / 1024 * 1024, 0);
+        }
+        for (size_t done = 0; done < bytes;) {
+            ssize_t n = pread(in_fd, &image[offset + done], bytes - done, done);
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool copy_to(int first, int out_fd, size_t bytes) {
+        std::vector<char> data(1024 * ((bytes + 1023) / 1024));
+        read(first, data.size() / 1024, data.data());
+        for (size_t done = 0; done < bytes;) {
+            ssize_t n = ::write(out_fd, &data[done], bytes - done);
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+};
+
 //test
 bool mounted = false;
 char buffer[1024];
 Super_block *superblock;
+Extension *extension;
+bool extension_on_disk = false;
+std::unordered_map<uint32_t, uint8_t> fingerprint_index; // content hash -> block holding that content
+uint32_t block_fingerprint[128];
+struct Dir_usage {
+    int blocks;       // blocks used by all files below the directory
+    int files;
+    int directories;
+};
+Dir_usage dir_usage[128];           // recursive totals of every directory, indexed like the inodes (127 is the root)
+int last_read_block[NUM_INODES];    // block each file was last read at, to detect sequential reads
+char readahead_data[1024 * READAHEAD_BLOCKS];
+int readahead_start = 0;            // first block held in readahead_data
+int readahead_count = 0;
+uint32_t journal_sequence = 0;
+
+/*
+ * The inode table one field per array, kept in step with the superblock by set_inode. Names are split into one
+ * array per character, so a scan checks a parent, a name or a prefix for 16 inodes with one compare per field.
+ */
+struct Inode_table {
+    alignas(16) char name[5][INODE_SLOTS];      // character j of every name, zero from the end of the name on
+    alignas(16) uint8_t parent[INODE_SLOTS];    // parent directory of every inode in use, NO_PARENT if unused
+    alignas(16) uint8_t used_size[INODE_SLOTS];
+    alignas(16) uint8_t start_block[INODE_SLOTS];
+    alignas(16) uint8_t directory[INODE_SLOTS];
+};
+Inode_table inode_table;
+uint32_t inode_generation[NUM_INODES];   // bumped whenever an inode is freed or taken, to tell its uses apart
+Block_device *disk = nullptr;       // the mounted disk
+Block_device *slow_disk = nullptr;  // the slow tier of a tiered disk
+uint32_t file_heat[NUM_INODES];     // accesses to each file, halved on every migrator pass
+int file_cold_passes[NUM_INODES];   // migrator passes since each file was last accessed
+int commands_since_migration = 0;
+int journal_pending = 0;            // commands since the last journal commit
+std::map<std::pair<Block_device *, int>, std::vector<char>> pending_blocks;  // data blocks written since then
+uint16_t pool_used[2][POOL_BLOCKS]; // granules in use in every pool block of the fast and the slow tier
 uint8_t current_directory_int = ROOT;    // start as root
 std::string current_disk;
 char zeros[1024] = {0};
@@ -69,6 +352,423 @@ void set_block_range_free(uint8_t start, uint8_t end) {
     }
 }
 
+inline bool compression_enabled() {
+    return extension->features & FEATURE_COMPRESS;
+}
+
+inline uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+bool lz_emit(uint8_t *out, int &op, int cap, const uint8_t *literals, int lit_len, int offset, int match_len) {
+    // worst case: token, literal length bytes, literals, offset and match length bytes
+    int need = 1 + lit_len / 255 + 1 + lit_len + (offset ? 2 + match_len / 255 + 1 : 0);
+    if (op + need > cap) {
+        return false;
+    }
+
+    int extra_match = offset ? match_len - LZ_MIN_MATCH : 0;
+    out[op++] = (uint8_t) ((std::min(lit_len, 15) << 4) | std::min(extra_match, 15));
+
+    if (lit_len >= 15) {
+        int n = lit_len - 15;
+        for (; n >= 255; n -= 255) out[op++] = 255;
+        out[op++] = (uint8_t) n;
+    }
+    memcpy(out + op, literals, lit_len);
+    op += lit_len;
+
+    if (!offset) {
+        return true;
+    }
+
+    out[op++] = offset & 0xff;
+    out[op++] = offset >> 8;
+    if (extra_match >= 15) {
+        int n = extra_match - 15;
+        for (; n >= 255; n -= 255) out[op++] = 255;
+        out[op++] = (uint8_t) n;
+    }
+    return true;
+}
+
+/*
+ * LZ77 compressor in the style of LZ4: every sequence is a token (literal count, match length), the literals and
+ * a 16-bit back reference. The last sequence carries literals only. Returns the compressed length, or 0 if the
+ * output would not fit in cap bytes.
+ */
+int lz_compress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *in = (const uint8_t *) src;
+    uint8_t *out = (uint8_t *) dst;
+    int table[1 << LZ_HASH_BITS];
+    std::fill(table, table + (1 << LZ_HASH_BITS), -1);
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    while (ip + LZ_MIN_MATCH <= len) {
+        uint32_t h = lz_hash(in + ip);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > 0xffff || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        int match_len = LZ_MIN_MATCH;
+        while (ip + match_len < len && in[ref + match_len] == in[ip + match_len]) {
+            match_len++;
+        }
+
+        if (!lz_emit(out, op, cap, in + anchor, ip - anchor, ip - ref, match_len)) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (!lz_emit(out, op, cap, in + anchor, len - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+// Returns the decompressed length, or -1 if the input is malformed or does not fit in cap bytes.
+int lz_decompress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *in = (const uint8_t *) src;
+    uint8_t *out = (uint8_t *) dst;
+    int ip = 0;
+    int op = 0;
+
+    while (ip < len) {
+        uint8_t token = in[ip++];
+
+        int lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return -1;
+                b = in[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (ip + lit_len > len || op + lit_len > cap) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == len) {
+            break;
+        }
+
+        if (ip + 2 > len) {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+
+        int match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return -1;
+                b = in[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || op + match_len > cap) {
+            return -1;
+        }
+        // byte by byte, matches may overlap the bytes they produce
+        for (int k = 0; k < match_len; k++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+
+    return op;
+}
+
+inline bool checksums_enabled() {
+    return extension->features & FEATURE_CHECKSUM;
+}
+
+inline bool dedup_enabled() {
+    return extension->features & FEATURE_DEDUP;
+}
+
+inline bool journal_enabled() {
+    return extension->features & FEATURE_JOURNAL;
+}
+
+inline bool tiering_enabled() {
+    return extension->features & FEATURE_TIER;
+}
+
+// whether every block holds its data as it is, in its own slot of the disk
+inline bool blocks_stored_verbatim() {
+    return !(extension->features & (FEATURE_COMPRESS | FEATURE_CHECKSUM | FEATURE_DEDUP | FEATURE_TIER));
+}
+
+inline bool block_on_slow_tier(int index) {
+    return extension->tier_slow[index / 8] & (1 << (7 - index % 8));
+}
+
+void set_block_tier(int index, bool slow) {
+    uint8_t mask = 1 << (7 - index % 8);
+    if (slow) {
+        extension->tier_slow[index / 8] |= mask;
+    } else {
+        extension->tier_slow[index / 8] &= ~mask;
+    }
+}
+
+// the device holding the data of block index
+inline Block_device *tier_device(int index) {
+    return block_on_slow_tier(index) ? slow_disk : disk;
+}
+
+// reads count blocks of dev, including the blocks written since the last journal commit
+bool device_read(Block_device *dev, int first, int count, char *data) {
+    bool ok = dev->read(first, count, data);
+    for (auto it = pending_blocks.lower_bound(std::make_pair(dev, first));
+         it != pending_blocks.end() && it->first.first == dev && it->first.second < first + count; ++it) {
+        memcpy(data + 1024 * (it->first.second - first), it->second.data(), 1024);
+    }
+    return ok;
+}
+
+// with the journal on, data blocks are held back and written with the metadata of their group
+bool device_write(Block_device *dev, int index, const char *data) {
+    if (journal_enabled()) {
+        pending_blocks[std::make_pair(dev, index)].assign(data, data + 1024);
+        return true;
+    }
+    return dev->write(index, 1, data);
+}
+
+// zeroes a block, handing its space back to the host unless the zeros wait for a journal commit
+bool device_zero(Block_device *dev, int index) {
+    if (journal_enabled()) {
+        return device_write(dev, index, zeros);
+    }
+    return dev->zero(index, 1);
+}
+
+inline bool block_packed(int index) {
+    return extension->packed_at[index];
+}
+
+// granules of the pool block holding the packed bytes of a block, as a mask
+inline uint32_t fragment_mask(uint16_t packed_at, int size) {
+    return ((1u << ((size + POOL_GRANULE - 1) / POOL_GRANULE)) - 1) << (packed_at - 1) % GRANULES_PER_BLOCK;
+}
+
+/*
+ * Marks the pool granules taken by the packed blocks of ext in pool. Returns false if a packed block is not
+ * compressed, runs past the end of its pool block or overlaps another packed block of its tier.
+ */
+bool map_pool(Extension *ext, uint16_t pool[2][POOL_BLOCKS]) {
+    memset(pool, 0, sizeof(uint16_t) * 2 * POOL_BLOCKS);
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        uint16_t at = ext->packed_at[i];
+        if (!at) {
+            continue;
+        }
+
+        int size = ext->stored_size[i];
+        if (!size || ext->dedup_target[i] || at > POOL_BLOCKS * GRANULES_PER_BLOCK) {
+            return false;
+        }
+
+        uint32_t mask = fragment_mask(at, size);
+        bool slow = ext->tier_slow[i / 8] & (1 << (7 - i % 8));
+        uint16_t &used = pool[slow][(at - 1) / GRANULES_PER_BLOCK];
+        if (mask >> GRANULES_PER_BLOCK || (used & mask)) {
+            return false;
+        }
+        used |= mask;
+    }
+    return true;
+}
+
+// takes room for size bytes in the pool of a tier, returns where they start (as kept in packed_at) or 0 if it is full
+uint16_t pool_alloc(bool slow, int size) {
+    for (int p = 0; p < POOL_BLOCKS; p++) {
+        for (int g = 0; g < GRANULES_PER_BLOCK; g++) {
+            uint16_t at = p * GRANULES_PER_BLOCK + g + 1;
+            uint32_t mask = fragment_mask(at, size);
+            if (!(mask >> GRANULES_PER_BLOCK) && !(pool_used[slow][p] & mask)) {
+                pool_used[slow][p] |= mask;
+                return at;
+            }
+        }
+    }
+    return 0;
+}
+
+// gives back the pool granules at holds, zeroing its pool block once nothing is left in it
+void pool_free(bool slow, uint16_t at, int size) {
+    int p = (at - 1) / GRANULES_PER_BLOCK;
+    pool_used[slow][p] &= ~fragment_mask(at, size);
+    if (!pool_used[slow][p]) {
+        device_zero(slow ? slow_disk : disk, POOL_START + p);
+    }
+}
+
+// reads the packed bytes of block index
+bool pool_read(uint8_t index, char *packed) {
+    uint16_t at = extension->packed_at[index];
+    char block[1024];
+    if (!device_read(tier_device(index), POOL_START + (at - 1) / GRANULES_PER_BLOCK, 1, block)) {
+        return false;
+    }
+    memcpy(packed, block + POOL_GRANULE * ((at - 1) % GRANULES_PER_BLOCK), extension->stored_size[index]);
+    return true;
+}
+
+// writes size packed bytes to the pool granules at of dev, the other packed blocks sharing its pool block stay as they are
+bool pool_write(Block_device *dev, uint16_t at, const char *packed, int size) {
+    char block[1024];
+    int p = POOL_START + (at - 1) / GRANULES_PER_BLOCK;
+    if (!device_read(dev, p, 1, block)) {
+        return false;
+    }
+    memcpy(block + POOL_GRANULE * ((at - 1) % GRANULES_PER_BLOCK), packed, size);
+    return device_write(dev, p, block);
+}
+
+uint32_t crc32c_table[8][256];
+
+// (a * b) mod p over GF(2), with polynomials in the reflected bit order of the crc
+uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^n mod p
+uint32_t crc32c_xpow(unsigned int n) {
+    uint32_t p = 1u << 31;
+    uint32_t x = 1u << 30;
+    for (; n; n >>= 1) {
+        if (n & 1) {
+            p = crc32c_multmodp(x, p);
+        }
+        x = crc32c_multmodp(x, x);
+    }
+    return p;
+}
+
+// slicing-by-8, for machines without the crc32 instruction
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; len; p++, len--) {
+        crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+uint64_t crc32c_stripe_k1;  // shifts a crc over two stripes, x^(2 * 8 * CRC32C_STRIPE - 33)
+uint64_t crc32c_stripe_k2;  // shifts a crc over one stripe, x^(8 * CRC32C_STRIPE - 33)
+
+/*
+ * The crc32 instruction has a latency of three cycles, so three stripes are checksummed in parallel and folded
+ * together with carry-less multiplies. Three stripes cover all but the last 16 bytes of a block.
+ */
+__attribute__((target("sse4.2,pclmul")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c0 = crc;
+    for (; len >= 3 * CRC32C_STRIPE; p += 3 * CRC32C_STRIPE, len -= 3 * CRC32C_STRIPE) {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for (size_t i = 0; i < CRC32C_STRIPE; i += 8) {
+            uint64_t v0;
+            uint64_t v1;
+            uint64_t v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC32C_STRIPE + i, 8);
+            memcpy(&v2, p + 2 * CRC32C_STRIPE + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+
+        __m128i a = _mm_clmulepi64_si128(_mm_cvtsi64_si128(c0), _mm_cvtsi64_si128(crc32c_stripe_k1), 0);
+        __m128i b = _mm_clmulepi64_si128(_mm_cvtsi64_si128(c1), _mm_cvtsi64_si128(crc32c_stripe_k2), 0);
+        c0 = _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_xor_si128(a, b))) ^ c2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = _mm_crc32_u64(c0, v);
+    }
+    for (; len; p++, len--) {
+        c0 = _mm_crc32_u8((uint32_t) c0, *p);
+    }
+    return (uint32_t) c0;
+}
+#endif
+
+uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t) = nullptr;
+
+void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            crc32c_table[k][n] = crc32c_table[0][crc32c_table[k - 1][n] & 0xff] ^ (crc32c_table[k - 1][n] >> 8);
+        }
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        crc32c_stripe_k1 = crc32c_xpow(2 * 8 * CRC32C_STRIPE - 33);
+        crc32c_stripe_k2 = crc32c_xpow(8 * CRC32C_STRIPE - 33);
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+uint32_t crc32c(const char *data, size_t len) {
+    if (!crc32c_impl) {
+        crc32c_init();
+    }
+    return ~crc32c_impl(~0u, (const uint8_t *) data, len);
+}
 
 uint8_t get_node_size(Inode &inode) {
     return inode.used_size & 0x7f;
@@ -203,8 +903,12 @@ int consistency_check(Super_block *sb) {
 
         if (parent_idx == ROOT) continue;
 
-        Inode parent = get_parent_node(inode);
-        if (parent_idx < 0 || parent_idx > 125 ||!node_in_use(parent) || !is_directory(parent)) {
+        if (parent_idx > 125) {
+            return 6;
+        }
+
+        Inode parent = sb->inode[parent_idx];
+        if (!node_in_use(parent) || !is_directory(parent)) {
             return 6;
         }
     }
@@ -212,89 +916,693 @@ int consistency_check(Super_block *sb) {
     return 0;
 }
 
-int get_node_index(Inode inode) {
-    for (unsigned int i = 0; i < NUM_INODES; i++) {
-        if (superblock->inode[i] == inode) {
-            return i;
+int extension_check(Super_block *sb, Extension *ext) {
+    // Compressed lengths must fit in a block, only blocks in use can hold compressed data and compressed data
+    // is always packed into the pool.
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        if (ext->stored_size[i] >= 1024
+                || (ext->stored_size[i] && (i == 0 || block_marked_free(sb, i) || !ext->packed_at[i]))) {
+            return 7;
         }
     }
 
-    return -1;
+    // A shared block must be in use and point at a block in use that holds its own data, and the reference
+    // counts must match the number of blocks sharing each block.
+    int refs[NUM_BLOCKS] = {0};
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        uint8_t target = ext->dedup_target[i];
+        if (!target) {
+            continue;
+        }
+        if (i == 0 || block_marked_free(sb, i) || target >= NUM_BLOCKS || block_marked_free(sb, target)
+                || ext->dedup_target[target]) {
+            return 7;
+        }
+        refs[target]++;
+    }
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        if (refs[i] != ext->dedup_refs[i]) {
+            return 7;
+        }
+    }
+
+    uint16_t pool[2][POOL_BLOCKS];
+    if (!map_pool(ext, pool)) {
+        return 7;
+    }
+
+    return 0;
+}
+
+void set_inode(int idx, Inode inode) {
+    if (node_in_use(superblock->inode[idx]) != node_in_use(inode)) {
+        inode_generation[idx]++;
+    }
+    superblock->inode[idx] = inode;
+
+    bool ended = false;
+    for (int j = 0; j < 5; j++) {
+        ended = ended || !inode.name[j];
+        inode_table.name[j][idx] = ended ? 0 : inode.name[j];
+    }
+    inode_table.parent[idx] = node_in_use(inode) ? get_parent_node_index(inode) : NO_PARENT;
+    inode_table.used_size[idx] = inode.used_size;
+    inode_table.start_block[idx] = inode.start_block;
+    inode_table.directory[idx] = is_directory(inode);
+}
+
+void build_inode_table() {
+    memset(&inode_table, 0, sizeof(Inode_table));
+    memset(inode_table.parent, NO_PARENT, sizeof(inode_table.parent));
+    for (int i = 0; i < NUM_INODES; i++) {
+        set_inode(i, superblock->inode[i]);
+    }
+}
+
+// bit i is set if inode first + i is in use, is in directory parent (or anywhere for ANY_PARENT) and has a name
+// starting with the first len characters of key
+uint32_t match_inodes_sw(int first, int parent, const char *key, int len) {
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; i++) {
+        uint8_t p = inode_table.parent[first + i];
+        bool match = parent == ANY_PARENT ? p != NO_PARENT : p == parent;
+        for (int j = 0; match && j < len; j++) {
+            match = inode_table.name[j][first + i] == key[j];
+        }
+        mask |= (uint32_t) match << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__)
+uint32_t match_inodes_sse2(int first, int parent, const char *key, int len) {
+    __m128i parents = _mm_load_si128((const __m128i *) &inode_table.parent[first]);
+    __m128i match;
+    if (parent == ANY_PARENT) {
+        match = _mm_xor_si128(_mm_cmpeq_epi8(parents, _mm_set1_epi8((char) NO_PARENT)), _mm_set1_epi8(-1));
+    } else {
+        match = _mm_cmpeq_epi8(parents, _mm_set1_epi8((char) parent));
+    }
+
+    for (int j = 0; j < len; j++) {
+        __m128i chars = _mm_load_si128((const __m128i *) &inode_table.name[j][first]);
+        match = _mm_and_si128(match, _mm_cmpeq_epi8(chars, _mm_set1_epi8(key[j])));
+    }
+    return _mm_movemask_epi8(match);
+}
+#endif
+
+// every x86-64 machine has SSE2, so the vector kernel needs no check at run time
+inline uint32_t match_inodes(int first, int parent, const char *key, int len) {
+#if defined(__x86_64__)
+    return match_inodes_sse2(first, parent, key, len);
+#else
+    return match_inodes_sw(first, parent, key, len);
+#endif
 }
 
 int get_node_index(char name[5], int directory) {
-    for (unsigned int i = 0; i < NUM_INODES; i++) {
-        if (!strncmp(superblock->inode[i].name, name, 5) && get_parent_node_index(superblock->inode[i]) == directory) {
-            return i;
+    char key[5];
+    memset(key, 0, 5);
+    memcpy(key, name, strnlen(name, 5));
+
+    for (int first = 0; first < NUM_INODES; first += 16) {
+        uint32_t mask = match_inodes(first, directory, key, 5);
+        if (mask) {
+            return first + __builtin_ctz(mask);
         }
     }
 
     return -1;
 }
 
+int get_node_index(Inode inode) {
+    return get_node_index(inode.name, get_parent_node_index(inode));
+}
+
 inline bool file_in_directory(char name[5], int directory) {
     return get_node_index(name, directory) >= 0;
 }
 
-void write_superblock() {
-    std::fstream file(current_disk, std::ios::binary | std::ios::in | std::ios::out);
-    file.seekp(0, std::ios::beg);
+void write_metadata() {
+    static_assert(sizeof(Super_block) == 1024, "superblock does not fit its block");
+    static_assert(sizeof(Extension) <= 1024 * EXT_BLOCKS, "extension area does not fit its blocks");
 
-    file.write(superblock->free_block_list, 16);
-    file.write((char *) &superblock->inode, sizeof(superblock->inode));
+    bool ok = disk->write(0, 1, (char *) superblock);
 
-    file.close();
-}
+    // the extension area lives past the data blocks and is only created once an optional mode is enabled
+    if (extension_on_disk || extension->features) {
+        char area[1024 * EXT_BLOCKS] = {0};
+        memcpy(area, extension, sizeof(Extension));
+        ok = disk->write(EXT_START, EXT_BLOCKS, area) && ok;
+        extension_on_disk = true;
+    }
 
-void move_data(uint8_t old_start, uint8_t new_start, uint8_t size) {
-    char to_copy[1024];
-    std::fstream file(current_disk, std::ios::binary | std::ios::in | std::ios::out);
+    if (!ok) {
+        std::cerr << "Error: Cannot write metadata on " << current_disk << std::endl;
+    }
+}
 
-    for (uint8_t i = 0; i < size; i++) {
-        file.seekg(1024 * (old_start + i));
-        file.read(to_copy, 1024);
+inline int journal_record_block(uint32_t sequence) {
+    return JOURNAL_START + JOURNAL_RECORD / 1024 * (sequence % 2);
+}
 
-        file.seekp(1024 * (new_start + i));
-        file.write(to_copy, 1024);
+// the index block and data blocks of a record follow both metadata slots
+inline int journal_data_block(uint32_t sequence) {
+    return JOURNAL_DATA_START + (1 + JOURNAL_DATA_BLOCKS) * (sequence % 2);
+}
 
-        memset(to_copy, 0, 1024);
-        file.seekp(1024 * (old_start + i));
-        file.write(zeros, 1024);
+// writes the data blocks logged in record to their home locations on the fast and the slow tier
+void journal_apply_data(const std::vector<char> &record, Block_device *fast, Block_device *slow) {
+    const Journal_header *header = (const Journal_header *) record.data();
+    const uint16_t *entries = (const uint16_t *) &record[JOURNAL_RECORD];
+
+    bool slow_written = false;
+    for (uint32_t i = 0; i < header->blocks; i++) {
+        Block_device *dev = entries[i] & JOURNAL_SLOW ? slow : fast;
+        int index = entries[i] & ~JOURNAL_SLOW;
+        const char *data = &record[JOURNAL_RECORD + 1024 * (1 + i)];
+
+        // zeroed blocks hand their space back to the host
+        bool zero = !memcmp(data, zeros, 1024);
+        if (!dev || !(zero ? dev->zero(index, 1) : dev->write(index, 1, data))) {
+            DEVICE_ERROR(index);
+            continue;
+        }
+        slow_written |= dev == slow;
     }
 
-    file.close();
+    // the fast disk is flushed by the next commit before it can reuse this slot, the slow one is not
+    if (slow_written) {
+        slow->flush();
+    }
 }
 
-void delete_file(Inode &inode) {
-    int idx = get_node_index(inode);
-    int size = get_node_size(inode);
-
-    set_block_range_free(inode.start_block, inode.start_block + size);
+/*
+ * Logs the superblock, extension area and the data blocks written since the last commit as one transaction and
+ * makes it durable with a single fsync, then writes them to their home locations. Records alternate between two
+ * slots, so the previous transaction survives a crash that tears the one being written. As no data block is
+ * overwritten before its group commits, a crash leaves the disk as it was after the last committed group.
+ */
+void journal_commit() {
+    int blocks = pending_blocks.size();
+    std::vector<char> record(JOURNAL_RECORD + (blocks ? 1024 * (1 + blocks) : 0), 0);
+    memcpy(&record[1024], superblock, sizeof(Super_block));
+    memcpy(&record[2048], extension, sizeof(Extension));
+
+    uint16_t *entries = (uint16_t *) &record[JOURNAL_RECORD];
+    int n = 0;
+    for (auto it = pending_blocks.begin(); it != pending_blocks.end(); ++it, n++) {
+        entries[n] = it->first.second | (it->first.first == disk ? 0 : JOURNAL_SLOW);
+        memcpy(&record[JOURNAL_RECORD + 1024 * (1 + n)], it->second.data(), 1024);
+    }
+    pending_blocks.clear();
 
-    std::fstream file(current_disk, std::ios::binary | std::ios::in | std::ios::out);
+    Journal_header *header = (Journal_header *) record.data();
+    memcpy(header->magic, JOURNAL_MAGIC, 4);
+    header->sequence = ++journal_sequence;
+    header->blocks = blocks;
+    header->checksum = crc32c(&record[1024], record.size() - 1024);
 
-    for (uint8_t i = inode.start_block; i < inode.start_block + size; i++){
-        file.seekp(1024 * i);
-        file.write(zeros, 1024);
+    bool ok = disk->write(journal_record_block(header->sequence), JOURNAL_RECORD / 1024, record.data());
+    if (ok && blocks) {
+        ok = disk->write(journal_data_block(header->sequence), 1 + blocks, &record[JOURNAL_RECORD]);
+    }
+    if (!ok || !disk->flush()) {
+        std::cerr << "Error: Cannot write journal on " << current_disk << std::endl;
     }
 
-    file.close();
+    journal_pending = 0;
+    journal_apply_data(record, disk, slow_disk);
+    write_metadata();
+}
 
-    memset(inode.name, 0, 5);
+// reads the record in slot of the journal of dev, returns false unless it is complete
+bool journal_read_record(Block_device *dev, uint32_t slot, std::vector<char> &record) {
+    record.assign(JOURNAL_RECORD, 0);
+    if (!dev->read(journal_record_block(slot), JOURNAL_RECORD / 1024, record.data())) {
+        return false;
+    }
+
+    Journal_header header;
+    memcpy(&header, record.data(), sizeof(Journal_header));
+    if (strncmp(header.magic, JOURNAL_MAGIC, 4) || header.blocks > JOURNAL_DATA_BLOCKS) {
+        return false;
+    }
+
+    if (header.blocks) {
+        record.resize(JOURNAL_RECORD + 1024 * (1 + header.blocks));
+        if (!dev->read(journal_data_block(slot), 1 + header.blocks, &record[JOURNAL_RECORD])) {
+            return false;
+        }
+    }
+    return header.checksum == crc32c(&record[1024], record.size() - 1024);
+}
+
+/*
+ * Replaces sb and ext with the latest committed transaction in the journal of dev and writes it back to its
+ * home location. Torn records fail their checksum and are discarded. The record is left in record, so its data
+ * blocks can be written home once the slow tier is open. Returns the sequence number of the replayed transaction,
+ * or 0 if the journal holds none.
+ */
+uint32_t journal_replay(Block_device *dev, Super_block *sb, Extension *ext, std::vector<char> &record) {
+    uint32_t latest = 0;
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        if (journal_read_record(dev, slot, record) && ((Journal_header *) record.data())->sequence > latest) {
+            latest = ((Journal_header *) record.data())->sequence;
+        }
+    }
+
+    if (!latest || !journal_read_record(dev, latest, record)) {
+        record.clear();
+        return 0;
+    }
+
+    memcpy(sb, &record[1024], sizeof(Super_block));
+    memcpy(ext, &record[2048], sizeof(Extension));
+
+    dev->write(0, 1, &record[1024]);
+    dev->write(EXT_START, EXT_BLOCKS, &record[2048]);
+    dev->flush();
+    return latest;
+}
+
+void write_superblock() {
+    if (!mounted) {
+        return;
+    }
+
+    // with the journal on, metadata only reaches the disk when a group of commands is committed
+    if (journal_enabled()) {
+        if (++journal_pending >= (int) extension->journal_group) {
+            journal_commit();
+        }
+        return;
+    }
+
+    write_metadata();
+}
+
+// number of bytes stored for block index, in its own slot or in the pool
+inline int stored_bytes(int index) {
+    return extension->stored_size[index] ? extension->stored_size[index] : 1024;
+}
+
+inline void drop_readahead() {
+    readahead_count = 0;
+}
+
+// reads count blocks from first on in one go, unless they are already held
+void prefetch_blocks(int first, int count) {
+    if (first >= readahead_start && first + count <= readahead_start + readahead_count) {
+        return;
+    }
+
+    // only blocks on the same tier are read in one go
+    bool slow = block_on_slow_tier(first);
+    for (int i = 1; i < count; i++) {
+        if (block_on_slow_tier(first + i) != slow) {
+            count = i;
+            break;
+        }
+    }
+
+    readahead_start = first;
+    readahead_count = device_read(tier_device(first), first, count, readahead_data) ? count : 0;
+}
+
+inline bool block_checksum_matches(uint8_t index, const char *stored, int size) {
+    return crc32c(stored, size) == extension->checksum[index];
+}
+
+bool read_block(uint8_t index, char *data) {
+    if (extension->dedup_target[index]) {
+        index = extension->dedup_target[index];
+    }
+
+    // only packed blocks are compressed, a block in its own slot is stored raw
+    char packed[1024];
+    bool is_packed = block_packed(index);
+    if (is_packed) {
+        if (!pool_read(index, packed)) {
+            DEVICE_ERROR(index);
+            memset(data, 0, 1024);
+            return false;
+        }
+    } else if (index >= readahead_start && index < readahead_start + readahead_count) {
+        memcpy(data, &readahead_data[1024 * (index - readahead_start)], 1024);
+    } else if (!device_read(tier_device(index), index, 1, data)) {
+        DEVICE_ERROR(index);
+        memset(data, 0, 1024);
+        return false;
+    }
+    if (checksums_enabled() && !block_checksum_matches(index, is_packed ? packed : data, stored_bytes(index))) {
+        std::cerr << "Error: Checksum mismatch in block " << (int) index << " on " << current_disk << std::endl;
+        memset(data, 0, 1024);
+        return false;
+    }
+
+    if (!is_packed) {
+        return true;
+    }
+
+    if (lz_decompress(packed, extension->stored_size[index], data, 1024) != 1024) {
+        std::cerr << "Error: Block " << (int) index << " on " << current_disk << " is corrupt\n";
+        memset(data, 0, 1024);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Compressed blocks are packed into the pool of their tier and their own slot is handed back, so they take only
+ * the granules their compressed bytes need. Returns false, leaving the block as it was, if the device fails.
+ */
+bool write_block(uint8_t index, const char *data) {
+    drop_readahead();
+
+    char packed[1024];
+    int size = compression_enabled() ? lz_compress(data, 1024, packed, 1023) : 0;
+    bool slow = block_on_slow_tier(index);
+    uint16_t at = size ? pool_alloc(slow, size) : 0;
+
+    // a block is stored raw in its own slot if it does not shrink (or, never with the pool sized as it is, the pool is full)
+    bool ok = at ? pool_write(tier_device(index), at, packed, size) : device_write(tier_device(index), index, data);
+    if (!ok) {
+        DEVICE_ERROR(index);
+        if (at) {
+            pool_free(slow, at, size);
+        }
+        return false;
+    }
+
+    if (block_packed(index)) {
+        pool_free(slow, extension->packed_at[index], extension->stored_size[index]);
+    } else if (at) {
+        device_zero(tier_device(index), index);
+    }
+    extension->packed_at[index] = at;
+    extension->stored_size[index] = at ? size : 0;
+    extension->checksum[index] = checksums_enabled() ? crc32c(at ? packed : data, at ? size : 1024) : 0;
+    return true;
+}
+
+// the block is released even if the device fails, it only keeps its stale contents
+bool zero_block(uint8_t index) {
+    drop_readahead();
+
+    // the own slot of a packed block is zero already
+    bool ok = true;
+    if (block_packed(index)) {
+        pool_free(block_on_slow_tier(index), extension->packed_at[index], extension->stored_size[index]);
+        extension->packed_at[index] = 0;
+    } else {
+        ok = device_zero(tier_device(index), index);
+    }
+    if (!ok) {
+        DEVICE_ERROR(index);
+    }
+    extension->stored_size[index] = 0;
+    extension->checksum[index] = 0;
+    set_block_tier(index, false);
+    return ok;
+}
+
+// newly allocated blocks are zero filled, as every block is zeroed when it is freed
+void init_block_range(uint8_t start, uint8_t end) {
+    uint32_t checksum = checksums_enabled() ? crc32c(zeros, 1024) : 0;
+    for (unsigned int i = start; i < end; i++) {
+        extension->stored_size[i] = 0;
+        extension->checksum[i] = checksum;
+    }
+}
+
+/*
+ * Copies the stored bytes of a block as they are, compressed blocks are not decompressed; the copy stays on the same
+ * tier. A packed block gets its copy packed next to it in the pool.
+ */
+bool copy_block(uint8_t from, uint8_t to) {
+    drop_readahead();
+
+    bool slow = block_on_slow_tier(from);
+    int size = extension->stored_size[from];
+    uint16_t at = block_packed(from) ? pool_alloc(slow, size) : 0;
+
+    char to_copy[1024];
+    bool ok;
+    if (block_packed(from)) {
+        ok = at && pool_read(from, to_copy) && pool_write(tier_device(from), at, to_copy, size);
+    } else {
+        ok = device_read(tier_device(from), from, 1, to_copy) && device_write(tier_device(from), to, to_copy);
+    }
+    if (!ok) {
+        DEVICE_ERROR(from);
+        if (at) {
+            pool_free(slow, at, size);
+        }
+        return false;
+    }
+
+    // whatever to held is stale once the copy is in place, unless the copy went over it
+    if (block_packed(to)) {
+        pool_free(block_on_slow_tier(to), extension->packed_at[to], extension->stored_size[to]);
+    } else if ((at || block_on_slow_tier(to) != slow) && !device_write(tier_device(to), to, zeros)) {
+        DEVICE_ERROR(to);
+    }
+
+    extension->packed_at[to] = at;
+    extension->stored_size[to] = size;
+    extension->checksum[to] = extension->checksum[from];
+    set_block_tier(to, slow);
+    return true;
+}
+
+void index_block(uint8_t index, uint32_t fingerprint) {
+    block_fingerprint[index] = fingerprint;
+    fingerprint_index.insert(std::make_pair(fingerprint, index));
+}
+
+void unindex_block(uint8_t index) {
+    auto it = fingerprint_index.find(block_fingerprint[index]);
+    if (it != fingerprint_index.end() && it->second == index) {
+        fingerprint_index.erase(it);
+    }
+}
+
+// returns a block holding exactly data, or 0 if there is none
+uint8_t find_duplicate(uint32_t fingerprint, const char *data) {
+    auto it = fingerprint_index.find(fingerprint);
+    if (it == fingerprint_index.end()) {
+        return 0;
+    }
+
+    char existing[1024];
+    if (!read_block(it->second, existing) || memcmp(existing, data, 1024)) {
+        return 0;
+    }
+    return it->second;
+}
+
+/*
+ * Makes block index hold nothing but its own data before it is overwritten or freed. A block sharing another
+ * block's data drops its reference; a block whose data is shared hands the data over to one of the blocks
+ * sharing it, which becomes the new target of the others.
+ */
+void unshare_block(uint8_t index) {
+    uint8_t target = extension->dedup_target[index];
+    if (target) {
+        extension->dedup_refs[target]--;
+        extension->dedup_target[index] = 0;
+        return;
+    }
+
+    unindex_block(index);
+    if (!extension->dedup_refs[index]) {
+        return;
+    }
+
+    int heir = 0;
+    for (int i = 1; i < NUM_BLOCKS; i++) {
+        if (extension->dedup_target[i] != index) {
+            continue;
+        }
+
+        if (!heir) {
+            heir = i;
+            extension->dedup_target[i] = 0;
+            copy_block(index, heir);
+        } else {
+            extension->dedup_target[i] = heir;
+        }
+    }
+
+    extension->dedup_refs[heir] = extension->dedup_refs[index] - 1;
+    extension->dedup_refs[index] = 0;
+    index_block(heir, block_fingerprint[index]);
+}
+
+// writes a block on behalf of a file, storing a reference instead of the data if another block already holds it
+bool store_block(uint8_t index, const char *data) {
+    unshare_block(index);
+
+    if (!dedup_enabled()) {
+        return write_block(index, data);
+    }
+
+    uint32_t fingerprint = crc32c(data, 1024);
+    uint8_t owner = find_duplicate(fingerprint, data);
+    if (owner) {
+        // the space of the old contents goes back to the host, the block keeps nothing but the reference
+        if (block_packed(index)) {
+            pool_free(block_on_slow_tier(index), extension->packed_at[index], extension->stored_size[index]);
+            extension->packed_at[index] = 0;
+        } else {
+            device_zero(tier_device(index), index);
+        }
+        set_block_tier(index, false);
+        extension->dedup_target[index] = owner;
+        extension->dedup_refs[owner]++;
+        extension->stored_size[index] = 0;
+        extension->checksum[index] = 0;
+        return true;
+    }
+
+    if (!write_block(index, data)) {
+        return false;
+    }
+    index_block(index, fingerprint);
+    return true;
+}
+
+void free_block(uint8_t index) {
+    unshare_block(index);
+    zero_block(index);
+}
+
+void build_fingerprint_index() {
+    fingerprint_index.clear();
+
+    char data[1024];
+    for (int i = 1; i < NUM_BLOCKS; i++) {
+        if (block_marked_free(superblock, i) || extension->dedup_target[i]) {
+            continue;
+        }
+
+        if (read_block(i, data)) {
+            index_block(i, crc32c(data, 1024));
+        }
+    }
+}
+
+void move_data(uint8_t old_start, uint8_t new_start, uint8_t size) {
+
+    for (uint8_t i = 0; i < size; i++) {
+        uint8_t old_index = old_start + i;
+        uint8_t new_index = new_start + i;
+
+        // a block sharing another block's data has nothing to copy, only the reference moves
+        uint8_t target = extension->dedup_target[old_index];
+        if (target) {
+            zero_block(old_index);
+            extension->dedup_target[old_index] = 0;
+            extension->dedup_target[new_index] = target;
+            continue;
+        }
+
+        copy_block(old_index, new_index);
+        zero_block(old_index);
+
+        if (extension->dedup_refs[old_index]) {
+            for (int j = 1; j < NUM_BLOCKS; j++) {
+                if (extension->dedup_target[j] == old_index) {
+                    extension->dedup_target[j] = new_index;
+                }
+            }
+            extension->dedup_refs[new_index] = extension->dedup_refs[old_index];
+            extension->dedup_refs[old_index] = 0;
+        }
+
+        auto it = fingerprint_index.find(block_fingerprint[old_index]);
+        if (it != fingerprint_index.end() && it->second == old_index) {
+            it->second = new_index;
+        }
+        block_fingerprint[new_index] = block_fingerprint[old_index];
+    }
+
+}
+
+// adds to the recursive totals of directory and every directory above it
+void charge_usage(int directory, int blocks, int files, int directories) {
+    for (int d = directory; ; d = get_parent_node_index(superblock->inode[d])) {
+        dir_usage[d].blocks += blocks;
+        dir_usage[d].files += files;
+        dir_usage[d].directories += directories;
+
+        if (d == ROOT) {
+            break;
+        }
+    }
+}
+
+void build_dir_usage() {
+    memset(dir_usage, 0, sizeof(dir_usage));
+
+    for (int first = 0; first < NUM_INODES; first += 16) {
+        for (uint32_t mask = match_inodes(first, ANY_PARENT, nullptr, 0); mask; mask &= mask - 1) {
+            int i = first + __builtin_ctz(mask);
+            if (inode_table.directory[i]) {
+                charge_usage(inode_table.parent[i], 0, 0, 1);
+            } else {
+                charge_usage(inode_table.parent[i], inode_table.used_size[i] & 0x7f, 1, 0);
+            }
+        }
+    }
+}
+
+// returns the first directory from directory up to the root whose quota blocks more blocks would exceed, or -1
+int quota_exceeded(int directory, int blocks) {
+    for (int d = directory; ; d = get_parent_node_index(superblock->inode[d])) {
+        if (extension->quota[d] && dir_usage[d].blocks + blocks > extension->quota[d]) {
+            return d;
+        }
+
+        if (d == ROOT) {
+            return -1;
+        }
+    }
+}
+
+inline std::string directory_name(int directory) {
+    return directory == ROOT ? std::string("/") : std::string(superblock->inode[directory].name, strnlen(superblock->inode[directory].name, 5));
+}
+
+void delete_file(Inode &inode) {
+    int idx = get_node_index(inode);
+    int size = get_node_size(inode);
+
+    charge_usage(get_parent_node_index(inode), -size, -1, 0);
+
+    set_block_range_free(inode.start_block, inode.start_block + size);
+
+    for (uint8_t i = inode.start_block; i < inode.start_block + size; i++){
+        free_block(i);
+    }
+
+    memset(inode.name, 0, 5);
     inode.start_block = 0;
     inode.used_size = 0;
     inode.dir_parent = 0;
 
-    superblock->inode[idx] = inode;
+    set_inode(idx, inode);
 }
 
 void delete_directory(Inode inode) {
     std::vector<Inode> nodes_to_delete;
     int idx = get_node_index(inode);
 
-    for (unsigned int i = 0; i < NUM_INODES; i++) {
-        if (get_parent_node_index(superblock->inode[i]) == idx) {
-            nodes_to_delete.push_back(superblock->inode[i]);
+    for (int first = 0; first < NUM_INODES; first += 16) {
+        for (uint32_t mask = match_inodes(first, idx, nullptr, 0); mask; mask &= mask - 1) {
+            nodes_to_delete.push_back(superblock->inode[first + __builtin_ctz(mask)]);
         }
     }
 
@@ -306,19 +1614,20 @@ void delete_directory(Inode inode) {
         }
     }
 
+    charge_usage(get_parent_node_index(inode), 0, 0, -1);
+    extension->quota[idx] = 0;
+
     memset(inode.name, 0, 5);
     inode.start_block = 0;
     inode.used_size = 0;
     inode.dir_parent = 0;
-    superblock->inode[idx] = inode;
+    set_inode(idx, inode);
 }
 
 int get_num_children(int index) {
     int cnt = 0;
-    for (int i = 0; i < NUM_INODES; i++) {
-        if (get_parent_node_index(superblock->inode[i]) == index) {
-            cnt++;
-        }
+    for (int first = 0; first < NUM_INODES; first += 16) {
+        cnt += __builtin_popcount(match_inodes(first, index, nullptr, 0));
     }
 
     return cnt + 2;
@@ -333,10 +1642,10 @@ int get_parent_num_children(int index) {
     return get_num_children(idx);
 }
 
-int find_contiguous_blocks(int size) {
+int find_contiguous_blocks(int size, int first) {
     int found_so_far = 0;
     int start = -1;
-    for (unsigned int i = 1; i <= NUM_BLOCKS; i++) {
+    for (int i = first; i < NUM_BLOCKS; i++) {
         if (block_marked_free(superblock, i)) {
             found_so_far++;
             if (start == -1) {
@@ -347,52 +1656,206 @@ int find_contiguous_blocks(int size) {
             start = -1;
         }
         if (found_so_far == size) {
-            break;
+            return start;
         }
     }
 
-    return start;
+    return -1;
 }
 
-void fs_mount(char *new_disk_name) {
-    // check if the virtual disk exists
-    if (!file_exists(new_disk_name)) {
-        std::cerr << "Error: Cannot find disk " << std::string(new_disk_name) << std::endl;
-        return;
+// block right after the last file in directory, where a new file in it is best placed
+int sibling_end(int directory) {
+    int end = 1;
+    for (int first = 0; first < NUM_INODES; first += 16) {
+        for (uint32_t mask = match_inodes(first, directory, nullptr, 0); mask; mask &= mask - 1) {
+            int i = first + __builtin_ctz(mask);
+            if (!inode_table.directory[i]) {
+                end = std::max(end, inode_table.start_block[i] + (inode_table.used_size[i] & 0x7f));
+            }
+        }
     }
+    return end;
+}
 
-    Super_block *sb = new Super_block;
-    std::fstream file(new_disk_name, std::ios::in | std::ios::out | std::ios::binary);
+/*
+ * Creates a disk holding an empty file system. The data blocks are either left as a hole (sparse) or reserved
+ * up front with fallocate, so no data block is ever written.
+ */
+bool make_disk(char *new_disk_name, bool preallocate) {
+    if (file_exists(new_disk_name)) {
+        std::cerr << "Error: Disk " << new_disk_name << " already exists\n";
+        return false;
+    }
 
-    if (!file.good()) {
-        std::cerr << "Couldn't open file" << std::endl;
-        file.close();
-        return;
+    int fd = open(new_disk_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot create disk " << new_disk_name << std::endl;
+        return false;
     }
 
-    file.read(sb->free_block_list, 16);
+    Super_block sb;
+    memset(&sb, 0, sizeof(Super_block));
 
-    for (unsigned int i = 0; i < NUM_INODES; i++) {
-        file.read(sb->inode[i].name, 5);
-        char rest_of_node[3];
-        file.read(rest_of_node, 3);
-        sb->inode[i].used_size = (uint8_t) rest_of_node[0];
-        sb->inode[i].start_block = (uint8_t) rest_of_node[1];
-        sb->inode[i].dir_parent = (uint8_t) rest_of_node[2];
+    bool ok = pwrite(fd, &sb, sizeof(Super_block), 0) == sizeof(Super_block);
+    if (ok && preallocate) {
+        ok = posix_fallocate(fd, 0, 1024 * NUM_BLOCKS) == 0;
+    } else if (ok) {
+        ok = ftruncate(fd, 1024 * NUM_BLOCKS) == 0;
+    }
+    close(fd);
+
+    if (!ok) {
+        std::cerr << "Error: Cannot size disk " << new_disk_name << std::endl;
+        unlink(new_disk_name);
+    }
+    return ok;
+}
+
+void fs_mkfs(char *new_disk_name, int preallocate) {
+    make_disk(new_disk_name, preallocate);
+}
+
+// mounts the file system on dev, which is kept as the mounted disk on success and deleted otherwise
+void mount_device(Block_device *dev, char *new_disk_name) {
+    // commands still waiting for a group commit belong to the disk mounted so far
+    if (mounted && journal_pending) {
+        journal_commit();
+    }
+
+    Super_block *sb = new Super_block;
+    dev->read(0, 1, (char *) sb);
+
+    Extension *ext = new Extension;
+    memset(ext, 0, sizeof(Extension));
+
+    bool has_extension = false;
+    if (dev->size() > EXT_START) {
+        char area[1024 * EXT_BLOCKS];
+        dev->read(EXT_START, EXT_BLOCKS, area);
+        memcpy(ext, area, sizeof(Extension));
+        has_extension = !strncmp(ext->magic, EXT_MAGIC, 4);
+    }
+
+    // a committed transaction in the journal is at least as new as the metadata at its home location
+    std::vector<char> record;
+    uint32_t sequence = journal_replay(dev, sb, ext, record);
+    if (sequence) {
+        has_extension = true;
     }
 
-    file.close();
+    if (!has_extension) {
+        memset(ext, 0, sizeof(Extension));
+        memcpy(ext->magic, EXT_MAGIC, 4);
+    }
 
     int check = consistency_check(sb);
+    if (!check) {
+        check = extension_check(sb, ext);
+    }
 
     if (check) {
         std::cerr << "Error: File system in " << new_disk_name << " is inconsistent (error code: " << check << ")\n";
+        delete dev;
         return;
     }
 
+    // a tiered disk cannot be used without the blocks kept on its slow tier
+    File_device *slow = nullptr;
+    if (ext->features & FEATURE_TIER) {
+        slow = new File_device(ext->tier_disk);
+        if (slow->fd < 0) {
+            std::cerr << "Error: Cannot open slow tier " << ext->tier_disk << " of " << new_disk_name << std::endl;
+            delete slow;
+            delete sb;
+            delete ext;
+            delete dev;
+            return;
+        }
+    }
+
+    if (sequence) {
+        journal_apply_data(record, dev, slow);
+        dev->flush();
+    }
+
+    delete disk;
+    disk = dev;
     mounted = true;
     superblock = sb;
+    build_inode_table();
+    extension = ext;
+    journal_sequence = sequence;
+    journal_pending = 0;
+    extension_on_disk = has_extension;
     current_disk = std::string(new_disk_name);
+
+    build_dir_usage();
+    map_pool(extension, pool_used);
+    memset(file_heat, 0, sizeof(file_heat));
+    memset(file_cold_passes, 0, sizeof(file_cold_passes));
+    commands_since_migration = 0;
+
+    delete slow_disk;
+    slow_disk = slow;
+    std::fill(last_read_block, last_read_block + NUM_INODES, -2);
+    drop_readahead();
+
+    fingerprint_index.clear();
+    if (dedup_enabled()) {
+        build_fingerprint_index();
+    }
+}
+
+void fs_mount(char *new_disk_name) {
+    // check if the virtual disk exists
+    if (!file_exists(new_disk_name)) {
+        std::cerr << "Error: Cannot find disk " << std::string(new_disk_name) << std::endl;
+        return;
+    }
+
+    File_device *dev = new File_device(new_disk_name);
+    if (dev->fd < 0) {
+        std::cerr << "Couldn't open file" << std::endl;
+        delete dev;
+        return;
+    }
+
+    mount_device(dev, new_disk_name);
+}
+
+// mounts a copy of a disk held in memory, or an empty one if there is no such disk, leaving the disk itself untouched
+void fs_mount_memory(char *new_disk_name) {
+    Memory_device *dev = new Memory_device;
+    if (file_exists(new_disk_name)) {
+        std::ifstream in(new_disk_name, std::ios::binary);
+        dev->image.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    } else {
+        dev->image.assign(1024 * NUM_BLOCKS, 0);
+    }
+
+    mount_device(dev, new_disk_name);
+}
+
+// writes an image of the mounted disk, so a disk mounted in memory can be kept
+void fs_save(char *disk_name) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    if (journal_pending) {
+        journal_commit();
+    }
+
+    std::vector<char> image(1024 * disk->size());
+    disk->read(0, disk->size(), image.data());
+
+    std::ofstream out(disk_name, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+    if (!out.good()) {
+        std::cerr << "Error: Cannot save disk to " << disk_name << std::endl;
+    }
+    out.close();
 }
 
 void fs_create(char name[5], int size) {
@@ -401,22 +1864,20 @@ void fs_create(char name[5], int size) {
         return;
     }
 
-    Inode inode;
-    bool found = false;
-    int idx = 0;
-    for (unsigned int i = 0; i < NUM_INODES; i++) {
-        if (!node_in_use(superblock->inode[i])) {
-            found = true;
-            inode = superblock->inode[i];
-            idx = i;
-            break;
+    // the first inode not in use; the slots past the last inode are never in use either
+    int idx = -1;
+    for (int first = 0; first < NUM_INODES && idx == -1; first += 16) {
+        uint32_t unused = ~match_inodes(first, ANY_PARENT, nullptr, 0) & 0xffff;
+        if (unused && first + __builtin_ctz(unused) < NUM_INODES) {
+            idx = first + __builtin_ctz(unused);
         }
     }
 
-    if (!found) {
+    if (idx == -1) {
         std::cerr << "Error: Superblock in disk " << current_disk << " is full, cannot create " << name << std::endl;
         return;
     }
+    Inode inode = superblock->inode[idx];
 
     std::string str_name(name);
     trim(str_name);
@@ -435,43 +1896,40 @@ void fs_create(char name[5], int size) {
         inode.start_block = 0;
         inode.dir_parent = 0x80 | current_directory_int;
 
-        superblock->inode[idx] = inode;
+        set_inode(idx, inode);
+        charge_usage(current_directory_int, 0, 0, 1);
         return;
     }
 
-    // find contiguous blocks for files
-    found = false;
-    int found_so_far = 0;
-    int start = -1;
-    for (unsigned int i = 1; i <= NUM_BLOCKS; i++) {
-        if (block_marked_free(superblock, i)) {
-            found_so_far++;
-            if (start == -1) {
-                start = i;
-            }
-        } else {
-            found_so_far = 0;
-            start = -1;
-        }
-        if (found_so_far == size) {
-            found = true;
-            break;
-        }
+    int over_quota = quota_exceeded(current_directory_int, size);
+    if (over_quota != -1) {
+        std::cerr << "Error: Quota of " << directory_name(over_quota) << " exceeded, cannot create " << str_name << std::endl;
+        return;
+    }
+
+    // find contiguous blocks for files, after the files already in the directory so that they are read in one sweep
+    int start = find_contiguous_blocks(size, sibling_end(current_directory_int));
+    if (start == -1) {
+        start = find_contiguous_blocks(size, 1);
     }
 
-    if (!found) {
+    if (start == -1) {
         std::cerr << "Error: Cannot allocate " << size << " on " << current_disk << std::endl;
         return;
     }
 
     set_block_range_used(start, start + size);
+    init_block_range(start, start + size);
 
     strncpy(inode.name, str_name.c_str(), 5);
     inode.used_size = 0x80 | size;
     inode.start_block = (uint8_t) start;
     inode.dir_parent = current_directory_int;
 
-    superblock->inode[idx] = inode;
+    set_inode(idx, inode);
+    charge_usage(current_directory_int, size, 1, 0);
+    file_heat[idx] = 0;
+    file_cold_passes[idx] = 0;
 }
 
 void fs_delete(char name[5]) {
@@ -521,10 +1979,14 @@ void fs_read(char name[5], int block_num) {
         return;
     }
 
-    std::fstream file(current_disk, std::ios::in | std::ios::out | std::ios::binary);
-    file.seekg(1024 * (inode.start_block + block_num));
-    file.read(buffer, 1024);
-    file.close();
+    // a file read block after block gets the blocks that follow fetched along with the one asked for
+    if (block_num == last_read_block[idx] + 1) {
+        prefetch_blocks(inode.start_block + block_num, std::min(READAHEAD_BLOCKS, get_node_size(inode) - block_num));
+    }
+    last_read_block[idx] = block_num;
+
+    read_block(inode.start_block + block_num, buffer);
+    file_heat[idx]++;
 }
 
 void fs_write(char name[5], int block_num) {
@@ -549,10 +2011,10 @@ void fs_write(char name[5], int block_num) {
         return;
     }
 
-    std::fstream file(current_disk, std::ios::in | std::ios::out | std::ios::binary);
-    file.seekp(1024 * (inode.start_block + block_num));
-    file.write(buffer, 1024);
-    file.close();
+    if (!store_block(inode.start_block + block_num, buffer)) {
+        return;
+    }
+    file_heat[idx]++;
 }
 
 void fs_buff(char buff[1024]) {
@@ -576,17 +2038,103 @@ void fs_ls(void) {
     printf("%-5.5s %3d\n", ".", (int) get_num_children(current_directory_int));
     printf("%-5.5s %3d\n", "..", (int) get_parent_num_children(current_directory_int));
 
-    for (int i = 0; i < NUM_INODES; i++) {
-        if (get_parent_node_index(superblock->inode[i]) == current_directory_int) {
-            if (is_directory(superblock->inode[i])) {
+    for (int first = 0; first < NUM_INODES; first += 16) {
+        for (uint32_t mask = match_inodes(first, current_directory_int, nullptr, 0); mask; mask &= mask - 1) {
+            int i = first + __builtin_ctz(mask);
+            if (inode_table.directory[i]) {
                 printf("%-5.5s %3d\n", superblock->inode[i].name, get_num_children(i));
             } else {
-                printf("%-5.5s %3d KB\n", superblock->inode[i].name, get_node_size(superblock->inode[i]));
+                printf("%-5.5s %3d KB\n", superblock->inode[i].name, inode_table.used_size[i] & 0x7f);
+            }
+        }
+    }
+}
+
+// lists the path of every file and directory whose name starts with prefix, anywhere on the disk
+void fs_find(char prefix[5]) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    std::vector<std::string> paths;
+    for (int first = 0; first < NUM_INODES; first += 16) {
+        for (uint32_t mask = match_inodes(first, ANY_PARENT, prefix, strnlen(prefix, 5)); mask; mask &= mask - 1) {
+            int i = first + __builtin_ctz(mask);
+
+            std::string path = inode_table.directory[i] ? "/" : "";
+            for (int d = i; d != ROOT; d = inode_table.parent[d]) {
+                path = "/" + directory_name(d) + path;
+            }
+            paths.push_back(path);
+        }
+    }
+
+    std::sort(paths.begin(), paths.end());
+    for (unsigned int i = 0; i < paths.size(); i++) {
+        printf("%s\n", paths[i].c_str());
+    }
+}
+
+void list_usage(int directory, std::string path) {
+    for (int first = 0; first < NUM_INODES; first += 16) {
+        for (uint32_t mask = match_inodes(first, directory, nullptr, 0); mask; mask &= mask - 1) {
+            int i = first + __builtin_ctz(mask);
+            std::string name = path + std::string(superblock->inode[i].name, strnlen(superblock->inode[i].name, 5));
+            if (inode_table.directory[i]) {
+                printf("%-24s %3d KB %3d files %3d dirs", (name + "/").c_str(), dir_usage[i].blocks,
+                       dir_usage[i].files, dir_usage[i].directories);
+                if (extension->quota[i]) {
+                    printf(" (quota %d KB)", extension->quota[i]);
+                }
+                printf("\n");
+                list_usage(i, name + "/");
+            } else {
+                printf("%-24s %3d KB\n", name.c_str(), inode_table.used_size[i] & 0x7f);
             }
         }
     }
 }
 
+void fs_du(void) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    Dir_usage usage = dir_usage[current_directory_int];
+    printf("%-24s %3d KB %3d files %3d dirs", ".", usage.blocks, usage.files, usage.directories);
+    if (extension->quota[current_directory_int]) {
+        printf(" (quota %d KB)", extension->quota[current_directory_int]);
+    }
+    printf("\n");
+    list_usage(current_directory_int, "");
+}
+
+void fs_quota(char name[5], int blocks) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    std::string dir(name);
+    int idx = current_directory_int;
+    if (!dir.compare("..")) {
+        idx = current_directory_int == ROOT ? ROOT : get_parent_node_index(superblock->inode[current_directory_int]);
+    } else if (dir.compare(".")) {
+        idx = get_node_index(name, current_directory_int);
+        if (idx == -1 || !is_directory(superblock->inode[idx])) {
+            std::cerr << "Error: Directory " << dir << " does not exist\n";
+            return;
+        }
+    }
+
+    extension->quota[idx] = blocks;
+    if (blocks) {
+        extension->features |= FEATURE_QUOTA;
+    }
+}
+
 void fs_resize(char name[5], int new_size) {
     if (!mounted) {
         MOUNT_ERROR();
@@ -604,27 +2152,31 @@ void fs_resize(char name[5], int new_size) {
 
     Inode inode = superblock->inode[idx];
     int size =  get_node_size(inode);
-    std::fstream file(current_disk, std::ios::binary | std::ios::in | std::ios::out);
+
+    int over_quota = quota_exceeded(current_directory_int, new_size - size);
+    if (new_size > size && over_quota != -1) {
+        std::cerr << "Error: Quota of " << directory_name(over_quota) << " exceeded, cannot expand " << str_name << std::endl;
+        return;
+    }
 
     if (new_size < size) {
         set_block_range_free(inode.start_block + new_size, inode.start_block + size);
 
         for (uint8_t i = inode.start_block + new_size; i < inode.start_block + size; i++){
-            file.seekp(1024 * i);
-            file.write(zeros, 1024);
+            free_block(i);
         }
 
-        file.close();
         inode.used_size = 0x80 | new_size;
 
-        superblock->inode[idx] = inode;
+        set_inode(idx, inode);
+        charge_usage(current_directory_int, new_size - size, 0, 0);
         return;
         //TODO
     }
 
     bool fits_original_position = true;
-    for (uint8_t j = inode.start_block + size; j < inode.start_block + new_size; j++) {
-        if (!block_marked_free(superblock, j)) {
+    for (int j = inode.start_block + size; j < inode.start_block + new_size; j++) {
+        if (j >= NUM_BLOCKS || !block_marked_free(superblock, j)) {
             fits_original_position = false;
             break;
         }
@@ -632,14 +2184,16 @@ void fs_resize(char name[5], int new_size) {
 
     if (fits_original_position) {
         inode.used_size = 0x80 | new_size;
-        superblock->inode[idx] = inode;
+        set_inode(idx, inode);
 
         set_block_range_used(inode.start_block, inode.start_block + new_size);
+        init_block_range(inode.start_block + size, inode.start_block + new_size);
+        charge_usage(current_directory_int, new_size - size, 0, 0);
     } else {
         bool found = false;
         int found_so_far = 0;
         int start = -1;
-        for (unsigned int i = 1; i <= 128; i++) {
+        for (unsigned int i = 1; i < NUM_BLOCKS; i++) {
             if (block_marked_free(superblock, i) || (i >= inode.start_block && i < inode.start_block + size)) {
                 found_so_far++;
                 if (start == -1) {
@@ -667,10 +2221,12 @@ void fs_resize(char name[5], int new_size) {
         set_block_range_used(start, start + new_size);
 
         move_data(inode.start_block, start, size);
+        init_block_range(start + size, start + new_size);
 
         inode.start_block = start;
         inode.used_size = 0x80 | new_size;
-        superblock->inode[idx] = inode;
+        set_inode(idx, inode);
+        charge_usage(current_directory_int, new_size - size, 0, 0);
     }
 }
 
@@ -690,30 +2246,25 @@ void fs_defrag(void) {
     if (nodes.empty()) return;
     std::sort(nodes.begin(), nodes.end(), cmp_nodes());
 
+    // files are packed in order of their start block, so a file is only ever moved towards the superblock
     int i = 1;
-    int j = 0;
-
-    std::fstream file(current_disk, std::ios::binary | std::ios::in | std::ios::out);
-    while (i <= NUM_BLOCKS && j < nodes.size()) {
-        if (block_marked_free(superblock, i)) {
-            Inode inode = superblock->inode[nodes[j]];
-            uint8_t start = inode.start_block;
-            uint8_t size = get_node_size(inode);
+    for (unsigned int j = 0; j < nodes.size(); j++) {
+        Inode inode = superblock->inode[nodes[j]];
+        uint8_t start = inode.start_block;
+        uint8_t size = get_node_size(inode);
 
+        if (start != i) {
             move_data(start, i, size);
 
             set_block_range_free(start, start + size);
             set_block_range_used(i, i + size);
 
             inode.start_block = i;
-            superblock->inode[nodes[j]] = inode;
-
-            j += 1;
-            i += size - 1;
+            set_inode(nodes[j], inode);
         }
-        i++;
+
+        i += size;
     }
-    file.close();
 }
 
 void fs_cd(char name[5]) {
@@ -746,164 +2297,1265 @@ void fs_cd(char name[5]) {
     current_directory_int = idx;
 }
 
-void run_commands(std::string input_file) {
-    std::ifstream infile(input_file);
-    std::string line;
-    long line_number = 0;
+void fs_import(char *host_file, char name[5]) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
 
-    while (std::getline(infile, line)) {
-        line_number++;
-        std::istringstream iss(line);
-        std::string cmd;
-        iss >> cmd;
+    std::string str_name(name);
+    trim(str_name);
 
-        if (!cmd.compare("M")) {
-            std::string disk_name;
-            iss >> disk_name;
+    struct stat st;
+    if (stat(host_file, &st) != 0) {
+        std::cerr << "Error: Cannot find host file " << host_file << std::endl;
+        return;
+    }
 
-            if (iss.fail() || !iss.eof()) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    int size = std::max(1, (int) ((st.st_size + 1023) / 1024));
+    if (size >= NUM_BLOCKS) {
+        std::cerr << "Error: Host file " << host_file << " is too large to import\n";
+        return;
+    }
 
-            fs_mount((char * ) disk_name.c_str());
-        } else if (!cmd.compare("C")) {
-            std::string file_name;
-            int size;
-            iss >> file_name >> size;
+    if (file_in_directory(name, current_directory_int)) {
+        FILE_EXIST(str_name);
+        return;
+    }
 
-            if (iss.fail() || !iss.eof()) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    fs_create(name, size);
+    int idx = get_node_index(name, current_directory_int);
+    if (idx == -1) {
+        return;
+    }
+    uint8_t start = superblock->inode[idx].start_block;
+
+    // unless an optional mode changes how blocks are stored, the file can be copied in one go
+    if (blocks_stored_verbatim()) {
+        // the file is copied straight into its blocks, so the inode it goes to must be committed first, and
+        // the writes of the pending group must not land over it
+        if (journal_enabled()) {
+            journal_commit();
+        }
+        drop_readahead();
+        int in_fd = open(host_file, O_RDONLY);
+        if (in_fd < 0 || !disk->copy_from(in_fd, start, st.st_size)) {
+            std::cerr << "Error: Cannot import " << host_file << std::endl;
+        }
+        close(in_fd);
+        return;
+    }
 
-            trim(file_name);
-            if (file_name.length() > 5 || !(0 <= size && size <= 127)) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    std::vector<char> data(1024 * size, 0);
+    std::ifstream in(host_file, std::ios::binary);
+    in.read(data.data(), st.st_size);
+    in.close();
 
-            fs_create((char * ) file_name.c_str(), size);
-        } else if (!cmd.compare("D")) {
-            std::string file_name;
-            iss >> file_name;
+    for (int i = 0; i < size; i++) {
+        if (!store_block(start + i, &data[1024 * i])) {
+            std::cerr << "Error: Cannot import " << host_file << std::endl;
+            return;
+        }
+    }
+}
 
-            if (iss.fail() || !iss.eof()) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+void fs_export(char name[5], char *host_file) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
 
-            trim(file_name);
-            if (file_name.length() > 5) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    std::string str_name(name);
+    trim(str_name);
 
-            fs_delete((char * ) file_name.c_str());
-        } else if (!cmd.compare("R")) {
-            std::string file_name;
-            int block_num;
-            iss >> file_name >> block_num;
+    int idx = get_node_index(name, current_directory_int);
+    if (idx == -1 || is_directory(superblock->inode[idx])) {
+        FILE_NOT_EXIST(str_name);
+        return;
+    }
 
-            if (iss.fail() || !iss.eof() || !(1 <= block_num && block_num <= 127)) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    Inode inode = superblock->inode[idx];
+    int size = get_node_size(inode);
 
-            trim(file_name);
-            if (file_name.length() > 5) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    if (blocks_stored_verbatim()) {
+        if (!pending_blocks.empty()) {
+            journal_commit();
+        }
+        int out_fd = open(host_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0 || !disk->copy_to(inode.start_block, out_fd, 1024 * size)) {
+            std::cerr << "Error: Cannot export " << str_name << " to " << host_file << std::endl;
+        }
+        close(out_fd);
+        return;
+    }
 
-            fs_read((char * ) file_name.c_str(), block_num);
-        } else if (!cmd.compare("W")) {
-            std::string file_name;
-            int block_num;
-            iss >> file_name >> block_num;
+    std::vector<char> data(1024 * size);
+    for (int i = 0; i < size; i++) {
+        if (!read_block(inode.start_block + i, &data[1024 * i])) {
+            std::cerr << "Error: Cannot export " << str_name << " to " << host_file << std::endl;
+            return;
+        }
+    }
 
-            if (iss.fail() || !iss.eof() || !(0 <= block_num && block_num <= 127)) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    std::ofstream out(host_file, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    if (!out.good()) {
+        std::cerr << "Error: Cannot export " << str_name << " to " << host_file << std::endl;
+    }
+    out.close();
+}
 
-            trim(file_name);
-            if (file_name.length() > 5) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+void fs_compress(int enable) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
 
-            fs_write((char * ) file_name.c_str(), block_num);
-        } else if (!cmd.compare("B")) {
-            std::string word;
-            iss >> word;
-            if (line.length() < 3 || !word.length()) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    if (enable) {
+        extension->features |= FEATURE_COMPRESS;
+    } else {
+        extension->features &= ~FEATURE_COMPRESS;
+    }
+
+    // re-encode every block in use, compressing it or restoring it to raw form
+    char data[1024];
+    for (int i = 1; i < NUM_BLOCKS; i++) {
+        if (block_marked_free(superblock, i) || extension->dedup_target[i] || (!enable && !extension->stored_size[i])) {
+            continue;
+        }
 
-            std::string in = line.substr(2);
-            if ( in.length() > 1000) {
-                COMMAND_ERROR(input_file, line_number);
+        if (read_block(i, data)) {
+            write_block(i, data);
+        }
+    }
+}
+
+// puts the packed bytes of the packed blocks from start to end in their place in data, reading each pool once
+bool read_packed(int start, int end, std::vector<char> &data) {
+    for (int slow = 0; slow < 2; slow++) {
+        std::vector<char> pool;
+        for (int i = start; i < end; i++) {
+            if (!block_packed(i) || block_on_slow_tier(i) != slow) {
                 continue;
             }
 
-            char buff[1024] = {0};
-            std::strcpy(buff, in .c_str());
-            fs_buff(buff);
-        } else if (!cmd.compare("L")) {
-            if (!iss.eof()) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
+            if (pool.empty()) {
+                pool.resize(1024 * POOL_BLOCKS);
+                if (!device_read(slow ? slow_disk : disk, POOL_START, POOL_BLOCKS, pool.data())) {
+                    return false;
+                }
             }
+            int at = extension->packed_at[i] - 1;
+            memcpy(&data[1024 * (i - start)], &pool[POOL_GRANULE * at], extension->stored_size[i]);
+        }
+    }
+    return true;
+}
 
-            fs_ls();
-        } else if (!cmd.compare("E")) {
-            std::string file_name;
-            int new_size;
-            iss >> file_name >> new_size;
+// reads blocks start to end in one pass over each tier, returns false if a device fails
+bool read_region(int start, int end, std::vector<char> &data) {
+    data.assign(1024 * (end - start), 0);
+    if (!device_read(disk, start, end - start, data.data())) {
+        return false;
+    }
 
-            if (iss.fail() || !iss.eof() || new_size < 1) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    if (!tiering_enabled()) {
+        return read_packed(start, end, data);
+    }
 
-            trim(file_name);
-            if (file_name.length() > 5) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    std::vector<char> slow_data(data.size());
+    if (!device_read(slow_disk, start, end - start, slow_data.data())) {
+        return false;
+    }
 
-            fs_resize((char * ) file_name.c_str(), new_size);
-        } else if (!cmd.compare("O")) {
-            if (!iss.eof()) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    for (int i = start; i < end; i++) {
+        if (block_on_slow_tier(i)) {
+            memcpy(&data[1024 * (i - start)], &slow_data[1024 * (i - start)], 1024);
+        }
+    }
+    return read_packed(start, end, data);
+}
+
+void fs_checksum(int enable) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
 
-            fs_defrag();
-        } else if (!cmd.compare("Y")) {
-            std::string file_name;
-            iss >> file_name;
+    // recomputing the checksums of a disk that has them would take any corruption since as the new contents
+    if (enable && checksums_enabled()) {
+        return;
+    }
 
-            if (iss.fail() || !iss.eof()) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
-            }
+    memset(extension->checksum, 0, sizeof(extension->checksum));
+    if (!enable) {
+        extension->features &= ~FEATURE_CHECKSUM;
+        return;
+    }
+    std::vector<char> data;
+    if (!read_region(1, NUM_BLOCKS, data)) {
+        std::cerr << "Error: Cannot read " << current_disk << std::endl;
+        return;
+    }
+    extension->features |= FEATURE_CHECKSUM;
 
-            trim(file_name);
-            if (file_name.length() > 5) {
-                COMMAND_ERROR(input_file, line_number);
-                continue;
+    for (int i = 1; i < NUM_BLOCKS; i++) {
+        if (!block_marked_free(superblock, i) && !extension->dedup_target[i]) {
+            extension->checksum[i] = crc32c(&data[1024 * (i - 1)], stored_bytes(i));
+        }
+    }
+}
+
+void scrub_range(int start, int end, std::vector<int> *corrupt) {
+    std::vector<char> data;
+    bool readable = read_region(start, end, data);
+
+    // a range the device cannot read counts as corrupt as a whole
+    for (int i = start; i < end; i++) {
+        if (!block_marked_free(superblock, i) && !extension->dedup_target[i] && (!readable || !block_checksum_matches(i, &data[1024 * (i - start)], stored_bytes(i)))) {
+            corrupt->push_back(i);
+        }
+    }
+}
+
+void fs_scrub(void) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    if (!checksums_enabled()) {
+        std::cerr << "Error: Checksums are not enabled on " << current_disk << std::endl;
+        return;
+    }
+
+    // every thread verifies a contiguous range of blocks that it reads in one pass
+    int num_threads = std::max(1, std::min((int) std::thread::hardware_concurrency(), 8));
+    int per_thread = (NUM_BLOCKS - 1 + num_threads - 1) / num_threads;
+    std::vector<std::vector<int>> corrupt(num_threads);
+    std::vector<std::thread> threads;
+
+    crc32c(zeros, 0);   // set up the crc tables before the threads use them
+    for (int t = 0; t < num_threads; t++) {
+        int start = 1 + t * per_thread;
+        int end = std::min(start + per_thread, NUM_BLOCKS);
+        if (start < end) {
+            threads.push_back(std::thread(scrub_range, start, end, &corrupt[t]));
+        }
+    }
+    for (unsigned int t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+
+    int errors = 0;
+    for (int t = 0; t < num_threads; t++) {
+        for (unsigned int j = 0; j < corrupt[t].size(); j++) {
+            std::cerr << "Error: Checksum mismatch in block " << corrupt[t][j] << " on " << current_disk << std::endl;
+            errors++;
+        }
+    }
+
+    int used_blocks = 0;
+    for (int i = 1; i < NUM_BLOCKS; i++) {
+        if (!block_marked_free(superblock, i)) {
+            used_blocks++;
+        }
+    }
+    printf("%-12s %3d blocks, %d errors\n", "scrub", used_blocks, errors);
+}
+
+void fs_dedup(int enable) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    if (!enable) {
+        // give every shared block its own copy of the data again
+        for (int i = 1; i < NUM_BLOCKS; i++) {
+            if (extension->dedup_target[i]) {
+                copy_block(extension->dedup_target[i], i);
+                extension->dedup_target[i] = 0;
             }
+        }
+        memset(extension->dedup_refs, 0, sizeof(extension->dedup_refs));
+        extension->features &= ~FEATURE_DEDUP;
+        fingerprint_index.clear();
+        return;
+    }
+
+    extension->features |= FEATURE_DEDUP;
+    fingerprint_index.clear();
 
-            fs_cd((char * ) file_name.c_str());
+    // share the data of every block that duplicates a block before it
+    char data[1024];
+    for (int i = 1; i < NUM_BLOCKS; i++) {
+        if (block_marked_free(superblock, i) || extension->dedup_target[i] || !read_block(i, data)) {
+            continue;
+        }
+
+        uint32_t fingerprint = crc32c(data, 1024);
+        uint8_t owner = extension->dedup_refs[i] ? 0 : find_duplicate(fingerprint, data);
+        if (owner) {
+            zero_block(i);
+            extension->dedup_target[i] = owner;
+            extension->dedup_refs[owner]++;
+        } else {
+            index_block(i, fingerprint);
         }
-        write_superblock();
     }
 }
 
-int main (int argc, char *argv[]) {
-    run_commands(std::string("/Users/ahmed/CLionProjects/untitled/consistency-input"));
+void fs_journal(int group) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    if (group) {
+        extension->features |= FEATURE_JOURNAL;
+        extension->journal_group = group;
+        return;
+    }
+
+    if (!journal_enabled()) {
+        return;
+    }
+
+    // the pending group goes home first, then the journal must not be replayed over metadata written after it
+    journal_commit();
+    extension->features &= ~FEATURE_JOURNAL;
+    extension->journal_group = 0;
+    write_metadata();
+
+    disk->flush();
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        disk->write(journal_record_block(slot), 1, zeros);
+    }
+    disk->flush();
+    journal_pending = 0;
+}
+
+/*
+ * Copies the blocks of a file that hold their own data to the slow or the fast tier and adds them to moved. A packed
+ * block is copied into the pool of the other tier, at the place left in packed_at. Blocks are read straight from the
+ * devices, so the data of a pending journal group must have gone home first.
+ */
+void copy_to_tier(int idx, bool slow, std::vector<int> &moved, uint16_t packed_at[NUM_BLOCKS]) {
+    Inode inode = superblock->inode[idx];
+    char data[1024];
+
+    Block_device *source = slow ? disk : slow_disk;
+    Block_device *target = slow ? slow_disk : disk;
+    for (int b = inode.start_block; b < inode.start_block + get_node_size(inode); b++) {
+        if (extension->dedup_target[b] || block_on_slow_tier(b) == slow) {
+            continue;
+        }
+
+        // a block that cannot be copied stays where it is
+        bool ok;
+        if (block_packed(b)) {
+            int size = extension->stored_size[b];
+            packed_at[b] = pool_alloc(slow, size);
+            ok = packed_at[b] && pool_read(b, data) && pool_write(target, packed_at[b], data, size);
+            if (!ok && packed_at[b]) {
+                pool_free(slow, packed_at[b], size);
+            }
+        } else {
+            ok = source->read(b, 1, data) && target->write(b, 1, data);
+        }
+        if (!ok) {
+            DEVICE_ERROR(b);
+            continue;
+        }
+        moved.push_back(b);
+    }
+}
+
+/*
+ * Finishes moving the blocks copied by a migrator pass, moved[1] to the slow tier and moved[0] to the fast one.
+ * Each target is made durable with one flush, then the tier bitmap is written with one commit (a journal
+ * transaction if the journal is on), and only then are the old copies released, so a crash at any point leaves
+ * the metadata pointing at a complete copy.
+ */
+void finish_migration(std::vector<int> moved[2], uint16_t packed_at[NUM_BLOCKS]) {
+    for (int slow = 0; slow < 2; slow++) {
+        Block_device *target = slow ? slow_disk : disk;
+        if (!moved[slow].empty() && !target->flush()) {
+            std::cerr << "Error: Cannot flush the " << (slow ? "slow" : "fast") << " tier of " << current_disk << std::endl;
+            for (unsigned int i = 0; i < moved[slow].size(); i++) {
+                if (packed_at[moved[slow][i]]) {
+                    pool_free(slow, packed_at[moved[slow][i]], extension->stored_size[moved[slow][i]]);
+                }
+            }
+            moved[slow].clear();
+        }
+    }
+
+    if (moved[0].empty() && moved[1].empty()) {
+        return;
+    }
+
+    // the packed blocks swap their place in the pool of one tier for their place in the other
+    for (int slow = 0; slow < 2; slow++) {
+        for (unsigned int i = 0; i < moved[slow].size(); i++) {
+            int b = moved[slow][i];
+            std::swap(packed_at[b], extension->packed_at[b]);
+            set_block_tier(b, slow);
+        }
+    }
+    if (journal_enabled()) {
+        journal_commit();
+    } else {
+        write_metadata();
+        disk->flush();
+    }
+
+    // the old copies are punched out, so the space goes back to the host
+    for (int slow = 0; slow < 2; slow++) {
+        Block_device *source = slow ? disk : slow_disk;
+        for (unsigned int i = 0; i < moved[slow].size(); i++) {
+            int b = moved[slow][i];
+            if (packed_at[b]) {
+                pool_free(!slow, packed_at[b], extension->stored_size[b]);
+            } else {
+                source->zero(b, 1);
+            }
+        }
+    }
+    drop_readahead();
+}
+
+// sends files that have not been accessed for a while to the slow tier and brings frequently accessed ones back
+void migrate_tiers() {
+    commands_since_migration = 0;
+
+    if (!pending_blocks.empty()) {
+        journal_commit();
+    }
+
+    std::vector<int> moved[2];
+    uint16_t packed_at[NUM_BLOCKS] = {0};
+    for (int i = 0; i < NUM_INODES; i++) {
+        Inode inode = superblock->inode[i];
+        if (!node_in_use(inode) || is_directory(inode)) {
+            continue;
+        }
+
+        file_cold_passes[i] = file_heat[i] ? 0 : file_cold_passes[i] + 1;
+        if (file_cold_passes[i] >= TIER_COLD_PASSES) {
+            copy_to_tier(i, true, moved[1], packed_at);
+        } else if (file_heat[i] >= TIER_HOT) {
+            copy_to_tier(i, false, moved[0], packed_at);
+        }
+        file_heat[i] /= 2;
+    }
+    finish_migration(moved, packed_at);
+}
+
+void fs_tier(char *slow_disk_name) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    // - brings every file back to the fast tier and detaches the slow one
+    if (!strcmp(slow_disk_name, "-")) {
+        if (!tiering_enabled()) {
+            return;
+        }
+
+        if (!pending_blocks.empty()) {
+            journal_commit();
+        }
+
+        std::vector<int> moved[2];
+        uint16_t packed_at[NUM_BLOCKS] = {0};
+        for (int i = 0; i < NUM_INODES; i++) {
+            if (node_in_use(superblock->inode[i]) && !is_directory(superblock->inode[i])) {
+                copy_to_tier(i, false, moved[0], packed_at);
+            }
+        }
+        finish_migration(moved, packed_at);
+        for (int i = 1; i < NUM_BLOCKS; i++) {
+            if (block_on_slow_tier(i) && !extension->dedup_target[i]) {
+                std::cerr << "Error: Cannot move block " << i << " off the slow tier of " << current_disk << std::endl;
+                return;
+            }
+        }
+
+        // the slow disk is left empty, so it can be attached again
+        slow_disk->zero(0, slow_disk->size());
+        slow_disk->flush();
+        extension->features &= ~FEATURE_TIER;
+        memset(extension->tier_disk, 0, sizeof(extension->tier_disk));
+        memset(extension->tier_slow, 0, sizeof(extension->tier_slow));
+        delete slow_disk;
+        slow_disk = nullptr;
+        return;
+    }
+
+    struct stat st;
+    if (tiering_enabled()) {
+        std::cerr << "Error: " << current_disk << " already has a slow tier\n";
+        return;
+    }
+    if (stat(slow_disk_name, &st) != 0 || st.st_size < 1024 * NUM_BLOCKS) {
+        std::cerr << "Error: Cannot find disk " << slow_disk_name << std::endl;
+        return;
+    }
+
+    // the migrator would copy blocks onto themselves and then punch them out
+    struct stat mounted_st;
+    if (stat(current_disk.c_str(), &mounted_st) == 0 && mounted_st.st_dev == st.st_dev && mounted_st.st_ino == st.st_ino) {
+        std::cerr << "Error: " << slow_disk_name << " is the mounted disk\n";
+        return;
+    }
+
+    // the disk is reopened by name on every mount, from whatever directory the mount is run in
+    char *path = realpath(slow_disk_name, nullptr);
+    if (!path) {
+        std::cerr << "Error: Cannot find disk " << slow_disk_name << std::endl;
+        return;
+    }
+    size_t length = strlen(path);
+    if (length >= sizeof(extension->tier_disk)) {
+        std::cerr << "Error: Disk name " << slow_disk_name << " is too long\n";
+        free(path);
+        return;
+    }
+
+    File_device *slow = new File_device(path);
+    if (slow->fd < 0) {
+        std::cerr << "Error: Cannot open disk " << slow_disk_name << std::endl;
+        delete slow;
+        free(path);
+        return;
+    }
+
+    // blocks are read from the slow tier as they are found there, so it must not hold anything yet
+    std::vector<char> contents(1024 * slow->size());
+    if (!slow->read(0, slow->size(), contents.data())
+            || std::any_of(contents.begin(), contents.end(), [](char c) { return c != 0; })) {
+        std::cerr << "Error: Disk " << slow_disk_name << " is not empty\n";
+        delete slow;
+        free(path);
+        return;
+    }
+
+    memset(extension->tier_disk, 0, sizeof(extension->tier_disk));
+    memcpy(extension->tier_disk, path, length);
+    free(path);
+    memset(extension->tier_slow, 0, sizeof(extension->tier_slow));
+    extension->features |= FEATURE_TIER;
+    slow_disk = slow;
+}
+
+void fs_migrate(void) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    if (!tiering_enabled()) {
+        std::cerr << "Error: " << current_disk << " has no slow tier\n";
+        return;
+    }
+
+    migrate_tiers();
+}
+
+void fs_stats(void) {
+    if (!mounted) {
+        MOUNT_ERROR();
+        return;
+    }
+
+    int used_inodes = 0;
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (node_in_use(superblock->inode[i])) {
+            used_inodes++;
+        }
+    }
+
+    // what the blocks take on disk: their own slots, unless they are shared or packed, and the pool blocks in use
+    int used_blocks = 0;
+    int shared_blocks = 0;
+    int physical_blocks = 0;
+    int packed_blocks = 0;
+    long packed_bytes = 0;
+    for (int i = 1; i < NUM_BLOCKS; i++) {
+        if (block_marked_free(superblock, i)) {
+            continue;
+        }
+
+        used_blocks++;
+        if (extension->dedup_target[i]) {
+            shared_blocks++;
+        } else if (block_packed(i)) {
+            packed_blocks++;
+            packed_bytes += POOL_GRANULE * ((extension->stored_size[i] + POOL_GRANULE - 1) / POOL_GRANULE);
+        } else {
+            physical_blocks++;
+        }
+    }
+    int pool_blocks = 0;
+    for (int p = 0; p < POOL_BLOCKS; p++) {
+        pool_blocks += (pool_used[0][p] != 0) + (pool_used[1][p] != 0);
+    }
+    long stored = 1024L * (physical_blocks + pool_blocks);
+
+    printf("%-12s %3d/%d\n", "inodes", used_inodes, NUM_INODES);
+    printf("%-12s %3d/%d\n", "blocks", used_blocks, NUM_BLOCKS - 1);
+    // a packed block takes its granules in the pool, so the ratio leaves shared and uncompressed blocks out
+    printf("%-12s %s, %ld/%ld bytes (%.2fx) in %d packed blocks\n", "compression", compression_enabled() ? "on" : "off",
+           packed_bytes, 1024L * packed_blocks, packed_bytes ? (double) (1024L * packed_blocks) / packed_bytes : 1.0,
+           packed_blocks);
+    printf("%-12s %s\n", "checksums", checksums_enabled() ? "on" : "off");
+    printf("%-12s %s, %d blocks shared\n", "dedup", dedup_enabled() ? "on" : "off", shared_blocks);
+    printf("%-12s %s, %d commands per commit\n", "journal", journal_enabled() ? "on" : "off",
+           (int) extension->journal_group);
+
+    int slow_blocks = 0;
+    for (int i = 1; i < NUM_BLOCKS; i++) {
+        slow_blocks += block_on_slow_tier(i);
+    }
+    printf("%-12s %s, %d blocks on the slow tier\n", "tiering", tiering_enabled() ? extension->tier_disk : "off",
+           slow_blocks);
+    printf("%-12s %ld bytes, %d pool blocks\n", "stored", stored, pool_blocks);
+}
+
+void run_command(std::string line, std::string input_file, long line_number) {
+    std::istringstream iss(line);
+    std::string cmd;
+    iss >> cmd;
+
+    if (!cmd.compare("M")) {
+        std::string disk_name;
+        iss >> disk_name;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_mount((char * ) disk_name.c_str());
+    } else if (!cmd.compare("A")) {
+        std::string disk_name;
+        iss >> disk_name;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_mount_memory((char * ) disk_name.c_str());
+    } else if (!cmd.compare("N")) {
+        std::string prefix;
+        iss >> prefix;
+
+        if (iss.fail() || !iss.eof() || prefix.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_find((char * ) prefix.c_str());
+    } else if (!cmd.compare("P")) {
+        std::string disk_name;
+        iss >> disk_name;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_save((char * ) disk_name.c_str());
+    } else if (!cmd.compare("F")) {
+        std::string disk_name;
+        int preallocate;
+        iss >> disk_name >> preallocate;
+
+        if (iss.fail() || !iss.eof() || !(preallocate == 0 || preallocate == 1)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_mkfs((char * ) disk_name.c_str(), preallocate);
+    } else if (!cmd.compare("C")) {
+        std::string file_name;
+        int size;
+        iss >> file_name >> size;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5 || !(0 <= size && size <= 127)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_create((char * ) file_name.c_str(), size);
+    } else if (!cmd.compare("D")) {
+        std::string file_name;
+        iss >> file_name;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_delete((char * ) file_name.c_str());
+    } else if (!cmd.compare("R")) {
+        std::string file_name;
+        int block_num;
+        iss >> file_name >> block_num;
+
+        if (iss.fail() || !iss.eof() || !(1 <= block_num && block_num <= 127)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_read((char * ) file_name.c_str(), block_num);
+    } else if (!cmd.compare("W")) {
+        std::string file_name;
+        int block_num;
+        iss >> file_name >> block_num;
+
+        if (iss.fail() || !iss.eof() || !(0 <= block_num && block_num <= 127)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_write((char * ) file_name.c_str(), block_num);
+    } else if (!cmd.compare("B")) {
+        std::string word;
+        iss >> word;
+        if (line.length() < 3 || !word.length()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        std::string in = line.substr(2);
+        if ( in.length() > 1000) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        char buff[1024] = {0};
+        std::strcpy(buff, in .c_str());
+        fs_buff(buff);
+    } else if (!cmd.compare("L")) {
+        if (!iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_ls();
+    } else if (!cmd.compare("E")) {
+        std::string file_name;
+        int new_size;
+        iss >> file_name >> new_size;
+
+        if (iss.fail() || !iss.eof() || new_size < 1) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_resize((char * ) file_name.c_str(), new_size);
+    } else if (!cmd.compare("O")) {
+        if (!iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_defrag();
+    } else if (!cmd.compare("Y")) {
+        std::string file_name;
+        iss >> file_name;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_cd((char * ) file_name.c_str());
+    } else if (!cmd.compare("Z")) {
+        int enable;
+        iss >> enable;
+
+        if (iss.fail() || !iss.eof() || !(enable == 0 || enable == 1)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_compress(enable);
+    } else if (!cmd.compare("S")) {
+        if (!iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_stats();
+    } else if (!cmd.compare("K")) {
+        int enable;
+        iss >> enable;
+
+        if (iss.fail() || !iss.eof() || !(enable == 0 || enable == 1)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_checksum(enable);
+    } else if (!cmd.compare("V")) {
+        if (!iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_scrub();
+    } else if (!cmd.compare("G")) {
+        int enable;
+        iss >> enable;
+
+        if (iss.fail() || !iss.eof() || !(enable == 0 || enable == 1)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_dedup(enable);
+    } else if (!cmd.compare("I")) {
+        std::string host_file;
+        std::string file_name;
+        iss >> host_file >> file_name;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_import((char * ) host_file.c_str(), (char * ) file_name.c_str());
+    } else if (!cmd.compare("X")) {
+        std::string file_name;
+        std::string host_file;
+        iss >> file_name >> host_file;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_export((char * ) file_name.c_str(), (char * ) host_file.c_str());
+    } else if (!cmd.compare("J")) {
+        int group;
+        iss >> group;
+
+        if (iss.fail() || !iss.eof() || !(0 <= group && group <= 1024)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_journal(group);
+    } else if (!cmd.compare("U")) {
+        if (!iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_du();
+    } else if (!cmd.compare("Q")) {
+        std::string file_name;
+        int blocks;
+        iss >> file_name >> blocks;
+
+        if (iss.fail() || !iss.eof() || !(0 <= blocks && blocks <= 127)) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        trim(file_name);
+        if (file_name.length() > 5) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_quota((char * ) file_name.c_str(), blocks);
+    } else if (!cmd.compare("T")) {
+        std::string disk_name;
+        iss >> disk_name;
+
+        if (iss.fail() || !iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_tier((char * ) disk_name.c_str());
+    } else if (!cmd.compare("H")) {
+        if (!iss.eof()) {
+            COMMAND_ERROR(input_file, line_number);
+            return;
+        }
+
+        fs_migrate();
+    }
+    write_superblock();
+
+    // the migrator runs in between commands
+    if (mounted && tiering_enabled() && ++commands_since_migration >= TIER_INTERVAL) {
+        migrate_tiers();
+    }
+}
+
+void run_commands(std::string input_file) {
+    std::ifstream infile(input_file);
+    std::string line;
+    long line_number = 0;
+
+    while (std::getline(infile, line)) {
+        line_number++;
+        run_command(line, input_file, line_number);
+    }
+
+    // commands left over from the last group are committed when the script ends
+    if (mounted && journal_pending) {
+        journal_commit();
+    }
+}
+
+struct Connection {
+    int fd;
+    bool framed;                // requests and responses are a 4-byte big-endian length followed by the bytes
+    long requests;
+    std::string input;          // bytes received but not yet run
+    std::string output;         // responses not yet sent
+    bool closed;                // the client has stopped sending
+    uint8_t directory;          // working directory of the connection
+    uint32_t generation;        // inode_generation of the working directory when the connection went into it
+    char buffer[1024];          // buffer of the connection
+};
+
+volatile sig_atomic_t serving = 1;
+
+void stop_serving(int) {
+    serving = 0;
+}
+
+// sends as much of the queued output as the socket takes without blocking; returns false if the connection broke
+bool send_output(Connection &conn) {
+    while (!conn.output.empty()) {
+        ssize_t n = send(conn.fd, conn.output.data(), conn.output.size(), MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        conn.output.erase(0, n);
+    }
+    return true;
+}
+
+// commands that mount or switch disks, or touch host files, would act on every client with the server's rights
+inline bool allowed_on_server(const std::string &request) {
+    std::string cmd;
+    std::istringstream(request) >> cmd;
+    return cmd.length() != 1 || !strchr("MAFTPIX", cmd[0]);
+}
+
+/*
+ * Runs one request in the context of its connection. Whatever the command prints to stdout or stderr lands in
+ * the capture file, which is queued as the response.
+ */
+void run_request(Connection &conn, const std::string &request, int capture) {
+    // the working directory may have been deleted by another connection, and its inode taken by a new file
+    if (conn.directory != ROOT && (!mounted || inode_generation[conn.directory] != conn.generation)) {
+        conn.directory = ROOT;
+    }
+    current_directory_int = conn.directory;
+    memcpy(buffer, conn.buffer, 1024);
+
+    int saved_stdout = dup(1);
+    int saved_stderr = dup(2);
+    fflush(stdout);
+    dup2(capture, 1);
+    dup2(capture, 2);
+
+    if (allowed_on_server(request)) {
+        run_command(request, "client " + std::to_string(conn.fd), ++conn.requests);
+    } else {
+        ++conn.requests;
+        std::cerr << "Error: Command " << request << " is not available on a server\n";
+    }
+
+    std::cout.flush();
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+    dup2(saved_stderr, 2);
+    close(saved_stdout);
+    close(saved_stderr);
+
+    conn.directory = current_directory_int;
+    conn.generation = conn.directory != ROOT ? inode_generation[conn.directory] : 0;
+    memcpy(conn.buffer, buffer, 1024);
+
+    std::string response(lseek(capture, 0, SEEK_END), 0);
+    pread(capture, &response[0], response.size(), 0);
+    ftruncate(capture, 0);
+    lseek(capture, 0, SEEK_SET);
+
+    if (conn.framed) {
+        uint32_t len = htonl(response.size());
+        conn.output.append((char *) &len, 4);
+    }
+    conn.output.append(response);
+}
+
+/*
+ * Runs the complete requests received on a connection, in order, until its queued output reaches MAX_OUTPUT.
+ * Returns false if the connection must be closed.
+ */
+bool run_requests(Connection &conn, int capture) {
+    size_t pos = 0;
+    while (conn.output.size() < MAX_OUTPUT) {
+        std::string request;
+        if (conn.framed) {
+            if (conn.input.size() - pos < 4) {
+                break;
+            }
+
+            uint32_t len;
+            memcpy(&len, &conn.input[pos], 4);
+            len = ntohl(len);
+            if (len > MAX_REQUEST) {
+                return false;
+            }
+            if (conn.input.size() - pos - 4 < len) {
+                break;
+            }
+
+            request = conn.input.substr(pos + 4, len);
+            pos += 4 + len;
+        } else {
+            size_t end = conn.input.find('\n', pos);
+            if (end == std::string::npos) {
+                if (conn.input.size() - pos > MAX_REQUEST) {
+                    return false;
+                }
+                break;
+            }
+
+            request = conn.input.substr(pos, end - pos);
+            pos = end + 1;
+        }
+
+        run_request(conn, request, capture);
+    }
+
+    conn.input.erase(0, pos);
+    return true;
+}
+
+/*
+ * Mounts disk_name once and serves the command language to any number of clients on a Unix domain socket. Every
+ * connection has its own working directory and buffer. A connection whose first byte is 0 speaks the framed
+ * protocol, otherwise requests are newline terminated lines. Requests are run one at a time in the order they
+ * arrive, so a client may send several before reading the responses. Sockets are non-blocking and responses are
+ * queued per connection, so a client that does not read cannot stall the others.
+ */
+void fs_serve(char *socket_path, char *disk_name) {
+    fs_mount(disk_name);
+    if (!mounted) {
+        return;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "Error: Cannot listen on " << socket_path << std::endl;
+        close(listener);
+        return;
+    }
+
+    FILE *capture_file = tmpfile();
+    int capture = fileno(capture_file);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_serving;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    std::vector<Connection> connections;
+    while (serving) {
+        std::vector<struct pollfd> fds(1 + connections.size());
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        // a connection is not read from while the client is not reading its responses
+        for (unsigned int i = 0; i < connections.size(); i++) {
+            fds[i + 1].fd = connections[i].fd;
+            fds[i + 1].events = 0;
+            if (!connections[i].closed && connections[i].output.size() < MAX_OUTPUT) {
+                fds[i + 1].events |= POLLIN;
+            }
+            if (!connections[i].output.empty()) {
+                fds[i + 1].events |= POLLOUT;
+            }
+        }
+
+        // an idle server commits the pending journal group; the migrator counts commands, as it does for a script,
+        // so the files of an idle server do not age
+        int timeout = mounted && journal_pending ? IDLE_COMMIT_MS : -1;
+
+        int ready = poll(fds.data(), fds.size(), timeout);
+        if (ready == 0) {
+            journal_commit();
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        for (unsigned int i = connections.size(); i > 0; i--) {
+            if (!fds[i].revents) {
+                continue;
+            }
+
+            Connection &conn = connections[i - 1];
+            bool ok = send_output(conn);
+
+            if (ok && (fds[i].revents & (POLLIN | POLLHUP)) && !conn.closed) {
+                char data[4096];
+                ssize_t n = recv(conn.fd, data, sizeof(data), 0);
+                if (n > 0 && conn.input.empty() && !conn.requests) {
+                    conn.framed = data[0] == 0;
+                }
+                if (n > 0) {
+                    conn.input.append(data, n);
+                } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    conn.closed = true;
+                }
+            }
+
+            // requests held back by a full output queue run as it drains
+            while (ok) {
+                size_t unrun = conn.input.size();
+                ok = run_requests(conn, capture) && send_output(conn);
+                if (conn.input.size() == unrun || !conn.output.empty()) {
+                    break;
+                }
+            }
+
+            // a client that stopped sending still gets the responses to everything it sent
+            bool done = conn.closed && conn.output.empty();
+            if (!ok || (fds[i].revents & POLLERR) || done) {
+                close(conn.fd);
+                connections.erase(connections.begin() + (i - 1));
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+                Connection conn;
+                conn.fd = fd;
+                conn.closed = false;
+                conn.framed = false;
+                conn.requests = 0;
+                conn.directory = ROOT;
+                conn.generation = 0;
+                memset(conn.buffer, 0, 1024);
+                connections.push_back(conn);
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < connections.size(); i++) {
+        close(connections[i].fd);
+    }
+    close(listener);
+    unlink(socket_path);
+    fclose(capture_file);
+
+    if (mounted && journal_pending) {
+        journal_commit();
+    }
+}
+
+// the tests build this file with FILESYSTEM_NO_MAIN to call its functions directly
+#ifndef FILESYSTEM_NO_MAIN
+int main (int argc, char *argv[]) {
+    // mkfs [--preallocate] <disk>... creates empty disks
+    if (argc >= 2 && !strcmp(argv[1], "mkfs")) {
+        int first = 2;
+        bool preallocate = argc >= 3 && !strcmp(argv[2], "--preallocate");
+        if (preallocate) {
+            first++;
+        }
+
+        int failed = 0;
+        for (int i = first; i < argc; i++) {
+            failed += !make_disk(argv[i], preallocate);
+        }
+        return first < argc && !failed ? 0 : 1;
+    }
+
+    // serve <socket> <disk> mounts the disk once and runs commands sent over a Unix domain socket
+    if (argc == 4 && !strcmp(argv[1], "serve")) {
+        fs_serve(argv[2], argv[3]);
+        return mounted ? 0 : 1;
+    }
+
+    run_commands(argc > 1 ? std::string(argv[1]) : std::string("/Users/ahmed/CLionProjects/untitled/consistency-input"));
     return 0;
 }
+#endif
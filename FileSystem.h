@@ -19,14 +19,53 @@ typedef struct {
     Inode inode[126];
 } Super_block;
 
+typedef struct {
+    char magic[4];            // "UFSX" when the extension area has been initialised
+    uint32_t features;        // Bitmask of the optional modes enabled on this disk
+    uint16_t stored_size[128]; // Compressed length of each block, 0 if the block is stored raw
+    uint32_t checksum[128];   // CRC32C of the stored bytes of each block in use
+    uint8_t dedup_target[128]; // Block whose data this block shares, 0 if the block holds its own data
+    uint8_t dedup_refs[128];  // Number of blocks sharing the data of this block
+    uint32_t journal_group;   // Number of commands committed together by the journal
+    uint8_t quota[128];       // Block limit of each directory's subtree, 0 if unlimited (127 is the root)
+    char tier_disk[96];       // Path of the slow tier disk, empty if the disk is not tiered
+    char tier_slow[16];       // Bitmap of the blocks whose data lives on the slow tier
+    uint16_t packed_at[128];  // Pool granule where the compressed bytes of each block start plus one, 0 if in its own slot
+} Extension;
+
+typedef struct {
+    char magic[4];            // "UFSJ" for a journal record
+    uint32_t sequence;        // Transaction number, the valid record with the highest one holds the latest metadata
+    uint32_t checksum;        // CRC32C of the payload, a mismatch means the record was torn by a crash
+    uint32_t blocks;          // Data blocks logged along with the metadata, 0 if the record holds metadata only
+} Journal_header;
+
+void fs_mkfs(char *new_disk_name, int preallocate);
 void fs_mount(char *new_disk_name);
+void fs_mount_memory(char *new_disk_name);
+void fs_save(char *disk_name);
 void fs_create(char name[5], int size);
 void fs_delete(char name[5]);
 void fs_read(char name[5], int block_num);
 void fs_write(char name[5], int block_num);
 void fs_buff(char buff[1024]);
 void fs_ls(void);
+void fs_find(char prefix[5]);
+void fs_du(void);
+void fs_quota(char name[5], int blocks);
 void fs_resize(char name[5], int new_size);
 void fs_defrag(void);
 void fs_cd(char name[5]);
+void fs_import(char *host_file, char name[5]);
+void fs_export(char name[5], char *host_file);
+void fs_compress(int enable);
+void fs_stats(void);
+void fs_checksum(int enable);
+void fs_scrub(void);
+void fs_dedup(int enable);
+void fs_journal(int group);
+void fs_tier(char *slow_disk_name);
+void fs_migrate(void);
+
+void fs_serve(char *socket_path, char *disk_name);
 #endif //UNTITLED_FILESYSTEM_H
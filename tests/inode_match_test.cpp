@@ -0,0 +1,58 @@
+#define FILESYSTEM_NO_MAIN
+#include "../FileSystem.cpp"
+
+/*
+ * Compares the inode matcher with its scalar version on random inode tables, for every group of 16 inodes, every
+ * directory and every key length. Names are made of two letters only, so that many of them share a prefix.
+ */
+int main(void) {
+    superblock = new Super_block;
+    memset(superblock, 0, sizeof(Super_block));
+    srand(1);
+
+    int failures = 0;
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < NUM_INODES; i++) {
+            Inode inode;
+            memset(&inode, 0, sizeof(Inode));
+            if (rand() % 4) {
+                int len = 1 + rand() % 5;
+                for (int j = 0; j < len; j++) {
+                    inode.name[j] = "ab"[rand() % 2];
+                }
+                bool directory = rand() % 4 == 0;
+                int parent = rand() % 5 ? rand() % 4 : ROOT;
+                inode.used_size = 0x80 | (directory ? 0 : 1 + rand() % 8);
+                inode.start_block = directory ? 0 : 1 + rand() % 100;
+                inode.dir_parent = (directory ? 0x80 : 0) | parent;
+            }
+            set_inode(i, inode);
+        }
+
+        const int parents[] = {ANY_PARENT, ROOT, 0, 1, 2, 3};
+        for (int first = 0; first < NUM_INODES; first += 16) {
+            for (int parent : parents) {
+                // a key that is a whole name, zero padded, and one made of random letters
+                char keys[2][5];
+                memcpy(keys[0], superblock->inode[first + rand() % 16 % (NUM_INODES - first)].name, 5);
+                for (int j = 0; j < 5; j++) {
+                    keys[1][j] = "ab"[rand() % 2];
+                }
+
+                for (const char *key : keys) {
+                    for (int len = 0; len <= 5; len++) {
+                        uint32_t mask = match_inodes(first, parent, key, len);
+                        uint32_t expected = match_inodes_sw(first, parent, key, len);
+                        if (mask != expected) {
+                            printf("FAIL: inodes %d, directory %d, key %.5s, length %d: %04x, expected %04x\n",
+                                   first, parent, key, len, mask, expected);
+                            failures++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return failures ? 1 : 0;
+}
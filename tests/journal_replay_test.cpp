@@ -0,0 +1,114 @@
+#define FILESYSTEM_NO_MAIN
+#include "../FileSystem.cpp"
+
+/*
+ * Crashes a journaled disk at the points a commit goes through and checks what mounting it again leaves:
+ * a crash before the commit loses the pending group, a crash after the record is durable but before the blocks
+ * reach their homes replays it, and a record torn by the crash is ignored in favour of the previous one.
+ */
+std::string disk_name, crash_name;
+int failures = 0;
+
+std::string read_image(const std::string &name) {
+    std::ifstream in(name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_image(const std::string &name, const std::string &image) {
+    std::ofstream out(name, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+}
+
+// drops the pending group, as a crash would, and mounts a disk holding image
+void crash(const std::string &image) {
+    pending_blocks.clear();
+    journal_pending = 0;
+    write_image(crash_name, image);
+    fs_mount((char *) crash_name.c_str());
+}
+
+// runs the commands making up the second group: g is created and block 1 of f is overwritten
+void second_group() {
+    fs_create((char *) "g", 1);
+    write_superblock();
+    memset(buffer, 'b', 1024);
+    fs_write((char *) "f", 1);
+    write_superblock();
+}
+
+void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+bool block_holds(const char *name, int block, char fill) {
+    memset(buffer, ~fill, 1024);
+    fs_read((char *) name, block);
+    return std::all_of(buffer, buffer + 1024, [fill](char c) { return c == fill; });
+}
+
+// checks that the mounted disk is consistent and holds the first group, or the second one as well
+void check_state(bool second, const char *when) {
+    std::string what = std::string(when) + ": ";
+    check(mounted && !consistency_check(superblock) && !extension_check(superblock, extension),
+          (what + "disk is not consistent").c_str());
+    check(block_holds("f", 0, 'a'), (what + "block 0 of f").c_str());
+    check(block_holds("f", 1, second ? 'b' : 'a'), (what + "block 1 of f").c_str());
+    check((get_node_index((char *) "g", ROOT) != -1) == second, (what + "g").c_str());
+}
+
+int main(void) {
+    char dir[] = "/tmp/journal_testXXXXXX";
+    if (!mkdtemp(dir)) {
+        return 1;
+    }
+    disk_name = std::string(dir) + "/disk";
+    crash_name = std::string(dir) + "/crash";
+
+    // the first group is committed: f is created and both its blocks are written
+    make_disk((char *) disk_name.c_str(), false);
+    fs_mount((char *) disk_name.c_str());
+    fs_journal(100);
+    write_superblock();
+    fs_create((char *) "f", 2);
+    write_superblock();
+    memset(buffer, 'a', 1024);
+    fs_write((char *) "f", 0);
+    fs_write((char *) "f", 1);
+    write_superblock();
+    journal_commit();
+
+    // a crash before the second group is committed leaves the disk as it was after the first one
+    second_group();
+    crash(read_image(disk_name));
+    check_state(false, "crash before the commit");
+
+    fs_mount((char *) disk_name.c_str());
+    second_group();
+    std::string before = read_image(disk_name);
+    journal_commit();
+    std::string after = read_image(disk_name);
+
+    // a crash once the record is durable, with none of the blocks at their homes, replays it on mount
+    std::string torn = before;
+    torn.resize(std::max(before.size(), after.size()), 0);
+    memcpy(&torn[1024 * JOURNAL_START], &after[1024 * JOURNAL_START], after.size() - 1024 * JOURNAL_START);
+    crash(torn);
+    check_state(true, "crash after the record");
+
+    // a crash in the middle of writing the record leaves it torn, so the record of the first group is replayed
+    int last = 1024 * POOL_START - 1;
+    while (last >= 1024 * JOURNAL_START && torn[last] == before[last]) {
+        last--;
+    }
+    torn[last] ^= 0xff;
+    crash(torn);
+    check_state(false, "crash while writing the record");
+
+    unlink(disk_name.c_str());
+    unlink(crash_name.c_str());
+    rmdir(dir);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Runs a script case in an empty directory and compares what it prints with the expected output next to it.
+# usage: run_script.sh <FileSystem> <case.txt>
+fs=$1
+case=$2
+dir=$(cd "$(mktemp -d)" && pwd -P) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+cp "$case" "$dir/script"
+cd "$dir" || exit 1
+"$fs" script > stdout 2> stderr
+
+# the slow tier is remembered by its absolute path, which is different on every run
+{ cat stdout; echo "--- stderr"; cat stderr; } | sed "s|$dir|<dir>|g" > actual
+diff -u "${case%.txt}.out" actual